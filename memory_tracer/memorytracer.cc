@@ -1,8 +1,9 @@
-#include "memorytracer.hh"
 #include "pin.H"
+#include "memorytracer.hh"
 #include <algorithm>
 #include <array>
 #include <map>
+#include <iomanip>
 #include <iostream>
 #include <unordered_map>
 
@@ -27,23 +28,51 @@ bool memstats_disable_memory_tracer() {
     return exchange(memstats_memory_tracing, false);
 }
 
-std::vector<MemoryOperation> MemoryTracer::operations;
-std::vector<MallocOperation> MemoryTracer::mallocOperations;
+std::atomic<size_t> MemoryTracer::mallocCount{0};
+std::map<ADDRINT, Allocation> MemoryTracer::allocations;
+std::map<ADDRINT, SiteUsage> MemoryTracer::sites;
+std::unordered_map<ADDRINT, CacheLine> MemoryTracer::lines;
+std::map<std::pair<ADDRINT, size_t>, FalseSharing> MemoryTracer::falseSharing;
+std::vector<ArrayOfArrays> MemoryTracer::arraysOfArrays;
+std::unordered_map<size_t, StoredBlock> MemoryTracer::storedBlocks;
+std::vector<ThreadData*> MemoryTracer::threads;
+static const HeapRanges noHeap;
+std::atomic<const HeapRanges*> MemoryTracer::heapRanges{&noHeap};
+std::vector<std::unique_ptr<HeapRanges>> MemoryTracer::heapSnapshots;
+TLS_KEY MemoryTracer::threadKey;
+PIN_LOCK MemoryTracer::lock;
+
+// number of accesses buffered per thread before they are applied to the allocations
+constexpr size_t flushBatch = size_t(1) << 16;
+
+constexpr ADDRINT cacheLine = 64;
+
+// heap ranges grow by this many bytes at least, so that a heap growing block by block is published seldom
+constexpr ADDRINT heapGranularity = ADDRINT(1) << 20;
+
+VOID malloc_before(ADDRINT size, ADDRINT site, THREADID tid) {
+    ThreadData* data = MemoryTracer::GetThreadData(tid);
+    // the size is kept on the calling thread until 'malloc' returns the address
+    if (data->mallocDepth++ == 0) {
+        data->mallocSize = size;
+        data->mallocSite = site;
+    }
+}
 
-VOID malloc_before(ADDRINT size) {
-    if (!memstats_do_memory_tracing())
+VOID malloc_after(ADDRINT ret, THREADID tid) {
+    ThreadData* data = MemoryTracer::GetThreadData(tid);
+    if (data->mallocDepth == 0 or --data->mallocDepth != 0)
+        return;
+    if (!memstats_do_memory_tracing() or !ret)
         return;
 
-    // Record malloc operation with nullptr as address since the adress is not known at this point
-    MemoryTracer::mallocOperations.push_back({nullptr, size});
+    MemoryTracer::RecordMalloc(reinterpret_cast<void*>(ret), data->mallocSize, data->mallocSite, tid);
 }
 
-VOID malloc_after(ADDRINT ret) {
-    if (!memstats_do_memory_tracing())
-        return;
-
-    // Update the address of the last malloc operation
-    MemoryTracer::mallocOperations.back().address = reinterpret_cast<void*>(ret);
+VOID free_before(ADDRINT ptr, THREADID tid) {
+    // frees are recorded even when tracing is disabled, a later block may reuse the address
+    if (ptr)
+        MemoryTracer::RecordFree(reinterpret_cast<void*>(ptr), tid);
 }
 
 VOID Image(IMG img, VOID *v) {
@@ -64,10 +93,20 @@ VOID Image(IMG img, VOID *v) {
     RTN mallocRtn = RTN_FindByName(img, "malloc");
     if (RTN_Valid(mallocRtn)) {
         RTN_Open(mallocRtn);
-        RTN_InsertCall(mallocRtn, IPOINT_BEFORE, AFUNPTR(malloc_before), IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
-        RTN_InsertCall(mallocRtn, IPOINT_AFTER, AFUNPTR(malloc_after), IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
+        RTN_InsertCall(mallocRtn, IPOINT_BEFORE, AFUNPTR(malloc_before), IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                       IARG_RETURN_IP, IARG_THREAD_ID, IARG_END);
+        RTN_InsertCall(mallocRtn, IPOINT_AFTER, AFUNPTR(malloc_after), IARG_FUNCRET_EXITPOINT_VALUE, IARG_THREAD_ID,
+                       IARG_END);
         RTN_Close(mallocRtn);
     }
+
+    RTN freeRtn = RTN_FindByName(img, "free");
+    if (RTN_Valid(freeRtn)) {
+        RTN_Open(freeRtn);
+        RTN_InsertCall(freeRtn, IPOINT_BEFORE, AFUNPTR(free_before), IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                       IARG_THREAD_ID, IARG_END);
+        RTN_Close(freeRtn);
+    }
 }
 
 int MemoryTracer::Init(int argc, char *argv[]) {
@@ -79,15 +118,29 @@ int MemoryTracer::Init(int argc, char *argv[]) {
     }
 
     PIN_InitSymbols();
+    PIN_InitLock(&lock);
+    threadKey = PIN_CreateThreadDataKey(nullptr);
+    if (threadKey == INVALID_TLS_KEY) {
+        std::cout << "Error PIN_CreateThreadDataKey" << std::endl;
+        return 1;
+    }
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
     IMG_AddInstrumentFunction(Image, 0);
     INS_AddInstrumentFunction([](INS ins, VOID* v) {
+        // accesses outside of the heap, e.g. to the stack or to globals, are dropped by an inlined check
         if (INS_IsMemoryRead(ins)) {
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordMemoryRead,
-                           IARG_INST_PTR, IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE, IARG_THREAD_ID, IARG_END);
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsHeapAddress, IARG_MEMORYREAD_EA, IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordMemoryRead,
+                               IARG_INST_PTR, IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE, IARG_THREAD_ID, IARG_END);
         }
         if (INS_IsMemoryWrite(ins)) {
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordMemoryWrite,
-                           IARG_INST_PTR, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE, IARG_THREAD_ID, IARG_END);
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsHeapAddress, IARG_MEMORYWRITE_EA, IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordMemoryWrite,
+                               IARG_INST_PTR, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE, IARG_THREAD_ID, IARG_END);
+            // the value of a store that may be a pointer is read once it is written
+            if (INS_MemoryWriteSize(ins) == sizeof(void*) and INS_IsValidForIpointAfter(ins))
+                INS_InsertCall(ins, IPOINT_AFTER, (AFUNPTR)RecordPointerStore, IARG_THREAD_ID, IARG_END);
         }
     }, nullptr);
     PIN_AddFiniFunction(Finalize, 0);
@@ -96,85 +149,590 @@ int MemoryTracer::Init(int argc, char *argv[]) {
     return 0;
 }
 
-void detect_arrays_of_arrays(const std::vector<MallocOperation>& calls) {
-    for (size_t i = 0; i < calls.size(); ++i) {
-        const auto& base_call = calls[i];
+// number of cache lines spanned by a block
+static size_t lines_of(const MallocOperation& call) {
+    const ADDRINT begin = reinterpret_cast<ADDRINT>(call.address);
+    return call.size ? (begin + call.size - 1) / cacheLine - begin / cacheLine + 1 : 0;
+}
 
-        // Check if it is a potential pointer array allocation (small size, multiple of 8)
-        if (base_call.size >= 8 && base_call.size % sizeof(void*) == 0) {
-            size_t n = base_call.size / sizeof(void*);
+/** Backs the advice to flatten an array of arrays with the simulated L1 misses of its blocks.
+ * A flattened layout is assumed to be swept as often as the separate blocks, so its misses scale
+ * with the number of cache lines it spans instead of the lines spanned by each block on its own.
+ */
+static void advise_flattening(const MallocOperation& base, const std::vector<const MallocOperation*>& inner) {
+    size_t accesses = base.accesses, misses = base.misses, lines = lines_of(base), bytes = 0;
+    for (const MallocOperation* call : inner) {
+        accesses += call->accesses;
+        misses += call->misses;
+        lines += lines_of(*call);
+        bytes += call->size;
+    }
+    if (!misses)
+        return;
+    const size_t flattened = (bytes + cacheLine - 1) / cacheLine;
+    std::cout << "Pointer-chasing across " << inner.size() << " inner arrays caused " << misses
+              << " simulated L1 misses in " << accesses << " accesses; a flattened layout of " << bytes
+              << " bytes would cause about " << misses * flattened / std::max<size_t>(lines, 1) << "\n";
+}
 
-            std::vector<void*> candidates;
-            size_t consistent_size = 0;
+/** Children of a pointer array that is retired, among the distinct blocks stored in its slots, if most of
+ * its slots were filled with the addresses of blocks of the same size. Looking at the stores themselves,
+ * rather than at the blocks allocated next to it, makes each block a single check when it is retired.
+ */
+std::vector<MallocOperation> detect_arrays_of_arrays(const Allocation& block, std::vector<MallocOperation> stored) {
+    const size_t n = block.size / sizeof(void*);
+    if (stored.size() < 2 or n < 2)
+        return {};
+
+    std::unordered_map<size_t, size_t> sizes;
+    for (const MallocOperation& child : stored)
+        ++sizes[child.size];
+    const auto consistent = std::max_element(sizes.begin(), sizes.end(), [](const auto& a, const auto& b) {
+        return a.second < b.second;
+    });
+    if (consistent->second < 2 or consistent->second < n / 2)
+        return {};
+
+    stored.erase(std::remove_if(stored.begin(), stored.end(), [&](const MallocOperation& child) {
+        return child.size != consistent->first;
+    }), stored.end());
+    return stored;
+}
 
-            // Search for n subsequent allocations with similar size
-            for (size_t j = i + 1; j < calls.size(); ++j) {
-                const auto& sub_call = calls[j];
+/** Prints the arrays of arrays found in the stores of the program, with the misses of their blocks. */
+void MemoryTracer::ReportArraysOfArrays() {
+    for (const ArrayOfArrays& found : arraysOfArrays) {
+        const MallocOperation& base_call = found.parent;
+        std::vector<const MallocOperation*> candidates;
+        for (const MallocOperation& child : found.children)
+            candidates.push_back(&child);
+
+        std::cout << "Array of arrays!\n";
+        std::cout << "Pointer-Array at: " << base_call.address << " (" << base_call.size << " Bytes, allocation #"
+                  << base_call.generation << ")\n";
+        std::cout << "Arrays stored in it (" << candidates.size() << " with size " << candidates.front()->size
+                  << "):\n";
+        for (const MallocOperation& child : found.children) {
+            std::cout << "  -> " << child.address << " (allocation #" << child.generation << ")\n";
+        }
+        advise_flattening(base_call, candidates);
+        std::cout << "--------------------------------------\n";
+    }
+}
 
-                if (candidates.empty()) {
-                    consistent_size = sub_call.size; // expected size
-                }
+void MemoryTracer::Finalize(INT32 code, VOID* v) {
+    // threads still running at exit have not flushed their accesses
+    for (ThreadData* data : threads) {
+        for (const MemoryOperation& op : data->buffer)
+            Touch(op, *data);
+        data->buffer.clear();
+    }
 
-                if (sub_call.size == consistent_size) {
-                    candidates.push_back(sub_call.address);
-                } else {
-                    break; // if size is not consistent, stop searching
-                }
+    // blocks that were never used are reported by their address as long as they are alive
+    for (const auto& [address, allocation] : allocations) {
+        if (allocation.size and !allocation.touched) {
+            std::cout << "Allocation at " << reinterpret_cast<void*>(address) << " (" << allocation.size
+                      << " bytes) was never used" << std::endl;
+        }
+    }
+    while (!allocations.empty())
+        Retire(allocations.begin());
+
+    ReportArraysOfArrays();
+    ReportUsage();
+    ReportAccessPatterns();
+    ReportFalseSharing();
+}
+
+/** Function and source location of 'site', to be called while holding the client lock. */
+static std::string site_name(ADDRINT site) {
+    INT32 line = 0;
+    std::string file;
+    PIN_GetSourceLocation(site, nullptr, &line, &file);
+    std::string name = RTN_FindNameByAddress(site);
+    if (name.empty())
+        name = "??";
+    if (!file.empty())
+        name += " (" + file + ":" + std::to_string(line) + ")";
+    return name;
+}
+
+/** Prints which fraction of the bytes allocated by each call site was accessed, most unused bytes first. */
+void MemoryTracer::ReportUsage() {
+    std::vector<std::pair<ADDRINT, SiteUsage>> usage(sites.begin(), sites.end());
+    std::sort(usage.begin(), usage.end(), [](const auto& a, const auto& b) {
+        return a.second.bytes - a.second.touched > b.second.bytes - b.second.touched;
+    });
+
+    std::cout << "Used bytes per allocation site:\n";
+    PIN_LockClient();
+    for (const auto& [site, stats] : usage) {
+        const double used = stats.bytes ? 100.0 * double(stats.touched) / double(stats.bytes) : 100.0;
+        std::cout << "  " << reinterpret_cast<void*>(site) << " " << site_name(site) << ": " << stats.allocations
+                  << " allocations, " << stats.touched << " of " << stats.bytes << " bytes used ("
+                  << std::fixed << std::setprecision(1) << used << " %), " << stats.unused
+                  << " never used (" << stats.unusedBytes << " bytes)\n";
+    }
+    PIN_UnlockClient();
+    std::cout << std::flush;
+}
+
+/** Prints how the blocks of each call site were accessed, most simulated L1 misses first. */
+void MemoryTracer::ReportAccessPatterns() {
+    std::vector<std::pair<ADDRINT, SiteUsage>> usage(sites.begin(), sites.end());
+    std::sort(usage.begin(), usage.end(), [](const auto& a, const auto& b) {
+        return a.second.pattern.l1Misses > b.second.pattern.l1Misses;
+    });
+
+    std::cout << "Access patterns per allocation site:\n";
+    PIN_LockClient();
+    for (const auto& [site, stats] : usage) {
+        const AccessPattern& pattern = stats.pattern;
+        if (!pattern.accesses)
+            continue;
+        const size_t classified = std::max<size_t>(pattern.sequential + pattern.strided + pattern.random, 1);
+        auto percent = [&](size_t count) { return 100.0 * double(count) / double(classified); };
+        std::cout << "  " << reinterpret_cast<void*>(site) << " " << site_name(site) << ": " << pattern.accesses
+                  << " accesses, " << std::fixed << std::setprecision(1) << percent(pattern.sequential)
+                  << " % sequential, " << percent(pattern.strided) << " % strided";
+        if (!stats.strides.empty()) {
+            const auto stride = std::max_element(stats.strides.begin(), stats.strides.end(),
+                                                 [](const auto& a, const auto& b) { return a.second < b.second; });
+            std::cout << " (mostly by " << stride->first << " bytes)";
+        }
+        std::cout << ", " << percent(pattern.random) << " % random, " << pattern.l1Misses << " L1 misses ("
+                  << 100.0 * double(pattern.l1Misses) / double(pattern.accesses) << " %), " << pattern.l2Misses
+                  << " L2 misses\n";
+    }
+    PIN_UnlockClient();
+    std::cout << std::flush;
+}
+
+/** Prints the cache lines written by several threads at different bytes, most writes first. */
+void MemoryTracer::ReportFalseSharing() {
+    if (falseSharing.empty())
+        return;
+    std::vector<std::pair<std::pair<ADDRINT, size_t>, FalseSharing>> found(falseSharing.begin(), falseSharing.end());
+    std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) {
+        return a.second.writes > b.second.writes;
+    });
+
+    std::cout << "False sharing of cache lines:\n";
+    PIN_LockClient();
+    for (const auto& [key, stats] : found) {
+        std::cout << "  " << reinterpret_cast<void*>(key.first) << " " << site_name(key.first) << ": "
+                  << stats.lines << " lines at offset " << key.second << " of the blocks, " << stats.writes
+                  << " writes and " << stats.reads << " reads by up to " << stats.threads << " threads\n";
+        for (const LineWriter& writer : stats.example) {
+            const size_t first = __builtin_ctzll(writer.bytes);
+            std::cout << "    thread " << writer.threadId << " wrote " << __builtin_popcountll(writer.bytes)
+                      << " bytes from byte " << first << " of the line " << writer.writes << " times, in block "
+                      << reinterpret_cast<void*>(writer.block) << " of " << reinterpret_cast<void*>(writer.site)
+                      << "\n";
+        }
+    }
+    PIN_UnlockClient();
+    std::cout << std::flush;
+}
+
+void MemoryTracer::RecordMalloc(void* address, size_t size, ADDRINT site, THREADID tid) {
+    // accesses of this thread to a block previously at the same address belong to that block
+    ThreadData& data = *GetThreadData(tid);
+    PIN_GetLock(&lock, tid + 1);
+    for (const MemoryOperation& op : data.buffer)
+        Touch(op, data);
+    data.buffer.clear();
+    data.pendingStore = 0;
+
+    // blocks overlapping the new one were released without a call to 'free' seen here, e.g. by 'realloc'
+    const ADDRINT begin = reinterpret_cast<ADDRINT>(address);
+    auto it = allocations.upper_bound(begin);
+    if (it != allocations.begin() and std::prev(it)->first + std::prev(it)->second.size > begin)
+        --it;
+    while (it != allocations.end() and it->first < begin + std::max<size_t>(size, 1))
+        Retire(it++);
+    Allocation& allocation = allocations[begin];
+    allocation.size = size;
+    allocation.site = site;
+    allocation.generation = mallocCount.fetch_add(1, std::memory_order_relaxed);
+    allocation.bits.assign((size + 63) / 64, 0);
+
+    GrowHeapRanges(begin, begin + std::max<size_t>(size, 1));
+    PIN_ReleaseLock(&lock);
+}
 
-                if (candidates.size() >= n) {
-                    break; // found enough candidates!
+void MemoryTracer::RecordFree(void* address, THREADID tid) {
+    // accesses of this thread before the 'free' belong to the block
+    ThreadData& data = *GetThreadData(tid);
+    PIN_GetLock(&lock, tid + 1);
+    for (const MemoryOperation& op : data.buffer)
+        Touch(op, data);
+    data.buffer.clear();
+    data.pendingStore = 0;
+
+    auto it = allocations.find(reinterpret_cast<ADDRINT>(address));
+    if (it != allocations.end())
+        Retire(it);
+    PIN_ReleaseLock(&lock);
+}
+
+ThreadData* MemoryTracer::GetThreadData(THREADID tid) {
+    return static_cast<ThreadData*>(PIN_GetThreadData(threadKey, tid));
+}
+
+/** Whether 'addr' may be in a block returned by 'malloc', in one of the heap ranges. Compares against every
+ * range without branching, so that PIN inlines it into the instrumented instruction. The ranges are read while
+ * other threads may grow them, so an access racing with the 'malloc' of its block may be dropped.
+ */
+ADDRINT MemoryTracer::IsHeapAddress(ADDRINT addr) {
+    static_assert(HeapRanges::capacity == 8, "one comparison per range");
+    const HeapRanges& r = *heapRanges.load(std::memory_order_acquire);
+    // unrolled by hand, so that it does not depend on the optimization flags of the tool
+    return ADDRINT(addr - r.low[0] < r.size[0]) | ADDRINT(addr - r.low[1] < r.size[1]) |
+           ADDRINT(addr - r.low[2] < r.size[2]) | ADDRINT(addr - r.low[3] < r.size[3]) |
+           ADDRINT(addr - r.low[4] < r.size[4]) | ADDRINT(addr - r.low[5] < r.size[5]) |
+           ADDRINT(addr - r.low[6] < r.size[6]) | ADDRINT(addr - r.low[7] < r.size[7]);
+}
+
+/** Publishes heap ranges that also cover the block from 'begin' to 'end', to be called while holding the lock.
+ * A block outside of the ranges gets its own, rounded to the granularity and merged with the ranges it touches;
+ * when there are too many, the two closest ones are merged with the gap between them.
+ */
+void MemoryTracer::GrowHeapRanges(ADDRINT begin, ADDRINT end) {
+    const HeapRanges& current = *heapRanges.load(std::memory_order_relaxed);
+    for (size_t i = 0; i != current.count; ++i)
+        if (begin - current.low[i] < current.size[i] and end - current.low[i] <= current.size[i])
+            return;
+
+    std::vector<std::pair<ADDRINT, ADDRINT>> bounds; // low and high of each range, sorted
+    for (size_t i = 0; i != current.count; ++i)
+        bounds.emplace_back(current.low[i], current.low[i] + current.size[i]);
+    const ADDRINT low = begin / heapGranularity * heapGranularity;
+    const ADDRINT high = (end + heapGranularity - 1) / heapGranularity * heapGranularity;
+    bounds.insert(std::upper_bound(bounds.begin(), bounds.end(), std::make_pair(low, high)), {low, high});
+
+    std::vector<std::pair<ADDRINT, ADDRINT>> merged;
+    for (const auto& range : bounds) {
+        if (!merged.empty() and range.first <= merged.back().second)
+            merged.back().second = std::max(merged.back().second, range.second);
+        else
+            merged.push_back(range);
+    }
+    while (merged.size() > HeapRanges::capacity) {
+        size_t closest = 0;
+        for (size_t i = 1; i + 1 < merged.size(); ++i)
+            if (merged[i + 1].first - merged[i].second < merged[closest + 1].first - merged[closest].second)
+                closest = i;
+        merged[closest].second = merged[closest + 1].second;
+        merged.erase(merged.begin() + closest + 1);
+    }
+
+    std::unique_ptr<HeapRanges> ranges(new HeapRanges);
+    for (const auto& range : merged) {
+        ranges->low[ranges->count] = range.first;
+        ranges->size[ranges->count++] = range.second - range.first;
+    }
+    heapRanges.store(ranges.get(), std::memory_order_release);
+    heapSnapshots.push_back(std::move(ranges));
+}
+
+void MemoryTracer::ThreadStart(THREADID tid, CONTEXT* ctxt, INT32 flags, VOID* v) {
+    ThreadData* data = new ThreadData;
+    data->buffer.reserve(flushBatch);
+    PIN_SetThreadData(threadKey, data, tid);
+
+    PIN_GetLock(&lock, tid + 1);
+    threads.push_back(data);
+    PIN_ReleaseLock(&lock);
+}
+
+void MemoryTracer::ThreadFini(THREADID tid, const CONTEXT* ctxt, INT32 code, VOID* v) {
+    Flush(*GetThreadData(tid), tid);
+}
+
+void MemoryTracer::Flush(ThreadData& data, THREADID tid) {
+    PIN_GetLock(&lock, tid + 1);
+    for (const MemoryOperation& op : data.buffer)
+        Touch(op, data);
+    PIN_ReleaseLock(&lock);
+    data.buffer.clear();
+    data.pendingStore = 0;
+}
+
+/** Marks the bytes of 'op' in the allocations it overlaps, in O(log n) per access, and runs the lines
+ * it accesses through the simulated caches of its thread.
+ */
+void MemoryTracer::Touch(const MemoryOperation& op, ThreadData& data) {
+    const ADDRINT end = op.address + op.size;
+    ADDRINT simulated = ~ADDRINT(0); // a line shared by two blocks is only accessed once
+    auto it = allocations.upper_bound(op.address);
+    if (it != allocations.begin())
+        --it;
+    for (; it != allocations.end() and it->first < end; ++it) {
+        Allocation& allocation = it->second;
+        const ADDRINT first = std::max<ADDRINT>(op.address, it->first) - it->first;
+        const ADDRINT last = std::min<ADDRINT>(end, it->first + allocation.size) - it->first;
+        // the block below may end before the access, e.g. one at a chunk header or in a block not recorded,
+        // and a block of 0 bytes has no byte to access
+        if (!allocation.size or first >= last)
+            continue;
+        // an access buffered by another thread before the block was allocated was to an earlier block at the
+        // address, which is already retired
+        if (allocation.generation >= op.mallocs)
+            continue;
+        for (ADDRINT offset = first; offset < last; ++offset) {
+            const uint64_t bit = uint64_t(1) << (offset % 64);
+            uint64_t& word = allocation.bits[offset / 64];
+            allocation.touched += !(word & bit);
+            word |= bit;
+        }
+        TouchLines(op, it->first, allocation, first, last);
+        TouchPattern(op, allocation, first, last);
+
+        // a pointer slot that now holds the start of another live block
+        if (op.value and last - first == sizeof(void*) and first % sizeof(void*) == 0) {
+            auto child = allocations.find(op.value);
+            if (child != allocations.end() and child != it) {
+                const std::pair<ADDRINT, size_t> stored(child->first, child->second.generation);
+                auto slot = allocation.children.emplace(first / sizeof(void*), stored);
+                if (slot.second or slot.first->second != stored) {
+                    if (!slot.second)
+                        Unreference(::exchange(slot.first->second, stored));
+                    ++child->second.references;
                 }
             }
+        }
 
-            if (candidates.size() >= n / 2) { // Toleranz für unvollständige Allokation
-                std::cout << "Possibly an array of arrays!\n";
-                std::cout << "Pointer-Array at: " << base_call.address << " (" << base_call.size << " Bytes)\n";
-                std::cout << "Arrays found (" << candidates.size() << " candidates with size " << consistent_size << "):\n";
-                for (auto addr : candidates) {
-                    std::cout << "  -> " << addr << "\n";
-                }
-                std::cout << "--------------------------------------\n";
+        for (ADDRINT line = (it->first + first) / cacheLine; line <= (it->first + last - 1) / cacheLine; ++line) {
+            if (line == simulated)
+                continue;
+            simulated = line;
+            if (!data.l1.Access(line)) {
+                ++allocation.pattern.l1Misses;
+                allocation.pattern.l2Misses += !data.l2.Access(line);
             }
         }
     }
 }
 
-void MemoryTracer::Finalize(INT32 code, VOID* v) {
-    detect_arrays_of_arrays(MemoryTracer::mallocOperations);
-
-    // find allocations that were never used
-    std::map<void*, size_t> allocations;
-    for (const auto& op : MemoryTracer::mallocOperations) {
-        allocations[op.address] = op.size;
+/** Classifies an access to the bytes 'first' to 'last' of a block by its distance to the previous access
+ * of the same thread. Repeated accesses to the same bytes are sequential and do not break a stride.
+ */
+void MemoryTracer::TouchPattern(const MemoryOperation& op, Allocation& allocation, ADDRINT first, ADDRINT last) {
+    AccessPattern& pattern = allocation.pattern;
+    ++pattern.accesses;
+    if (allocation.lastThread == op.threadId) {
+        const int64_t delta = int64_t(first) - int64_t(allocation.lastOffset);
+        if (delta == 0 or delta == int64_t(allocation.lastSize) or delta == -int64_t(last - first))
+            ++pattern.sequential;
+        else if (delta == allocation.lastDelta) {
+            ++pattern.strided;
+            if (!allocation.strideVotes)
+                allocation.stride = delta;
+            if (allocation.stride == delta)
+                ++allocation.strideVotes;
+            else
+                --allocation.strideVotes;
+        } else
+            ++pattern.random;
+        if (delta == 0)
+            return;
+        allocation.lastDelta = delta;
     }
-    for (const auto& op : MemoryTracer::operations) {
-        for (auto it = op.address; it < op.address + op.size; it += 8) {
-            allocations.erase(reinterpret_cast<void*>(it));
+    allocation.lastThread = op.threadId;
+    allocation.lastOffset = first;
+    allocation.lastSize = uint32_t(last - first);
+}
+
+CacheLevel::CacheLevel(size_t bytes, size_t ways) : sets(bytes / cacheLine / ways), ways(ways),
+                                                    tags(bytes / cacheLine, ~ADDRINT(0)) {}
+
+bool CacheLevel::Access(ADDRINT line) {
+    const auto set = tags.begin() + (line % sets) * ways;
+    auto way = std::find(set, set + ways, line);
+    const bool hit = way != set + ways;
+    if (!hit)
+        --way; // the least recently used line is evicted
+    std::rotate(set, way, way + 1);
+    *set = line;
+    return hit;
+}
+
+/** Records which bytes of each cache line the thread of 'op' writes, and counts reads of written lines. */
+void MemoryTracer::TouchLines(const MemoryOperation& op, ADDRINT block, const Allocation& allocation,
+                              ADDRINT first, ADDRINT last) {
+    for (ADDRINT address = block + first; address < block + last;) {
+        const ADDRINT line = address / cacheLine;
+        const ADDRINT next = std::min<ADDRINT>(block + last, (line + 1) * cacheLine);
+        if (!op.isWrite) {
+            auto found = lines.find(line);
+            if (found != lines.end())
+                ++found->second.reads;
+            address = next;
+            continue;
+        }
+
+        const size_t count = next - address;
+        const uint64_t mask = (count == 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1) << (address % cacheLine);
+        std::vector<LineWriter>& writers = lines[line].writers;
+        auto writer = std::find_if(writers.begin(), writers.end(), [&](const LineWriter& w) {
+            return w.threadId == op.threadId and w.block == block;
+        });
+        if (writer == writers.end())
+            writers.push_back({op.threadId, block, allocation.site, mask, 1});
+        else {
+            writer->bytes |= mask;
+            ++writer->writes;
         }
+        address = next;
+    }
+}
+
+/** Adds a block that was freed or is still alive at exit to the usage of its call site. */
+void MemoryTracer::Retire(std::map<ADDRINT, Allocation>::iterator it) {
+    CheckFalseSharing(it->first, it->second);
+    SiteUsage& usage = sites[it->second.site];
+    ++usage.allocations;
+    usage.bytes += it->second.size;
+    usage.touched += it->second.touched;
+    if (!it->second.touched) {
+        ++usage.unused;
+        usage.unusedBytes += it->second.size;
     }
-    for (const auto& [address, size] : allocations) {
-        std::cout << "Allocation at " << address << " (" << size << " bytes) was never used" << std::endl;
+
+    const AccessPattern& pattern = it->second.pattern;
+    usage.pattern.accesses += pattern.accesses;
+    usage.pattern.sequential += pattern.sequential;
+    usage.pattern.strided += pattern.strided;
+    usage.pattern.random += pattern.random;
+    usage.pattern.l1Misses += pattern.l1Misses;
+    usage.pattern.l2Misses += pattern.l2Misses;
+    if (pattern.strided)
+        usage.strides[it->second.stride] += pattern.strided;
+    const MallocOperation block{reinterpret_cast<void*>(it->first), it->second.size, it->second.generation,
+                                pattern.accesses, pattern.l1Misses};
+
+    if (!it->second.children.empty()) {
+        // a block stored in several slots is only counted once
+        std::vector<std::pair<ADDRINT, size_t>> distinct;
+        for (const auto& slot : it->second.children)
+            distinct.push_back(slot.second);
+        std::sort(distinct.begin(), distinct.end());
+        distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+        std::vector<MallocOperation> stored;
+        for (const auto& child : distinct)
+            stored.push_back(Stored(child));
+
+        std::vector<MallocOperation> children = detect_arrays_of_arrays(it->second, std::move(stored));
+        if (!children.empty())
+            arraysOfArrays.push_back({block, std::move(children)});
+        for (const auto& slot : it->second.children)
+            Unreference(slot.second);
+    }
+    if (it->second.references)
+        storedBlocks[it->second.generation] = {block, it->second.references};
+    allocations.erase(it);
+}
+
+/** Block at the address and of the generation stored in a pointer slot, live or retired since. */
+MallocOperation MemoryTracer::Stored(const std::pair<ADDRINT, size_t>& child) {
+    auto live = allocations.find(child.first);
+    if (live != allocations.end() and live->second.generation == child.second) {
+        const Allocation& allocation = live->second;
+        return {reinterpret_cast<void*>(child.first), allocation.size, allocation.generation,
+                allocation.pattern.accesses, allocation.pattern.l1Misses};
     }
+    return storedBlocks.at(child.second).block;
 }
 
-const std::vector<MemoryOperation>& MemoryTracer::GetOperations() {
-    return operations;
+/** Drops the reference of a pointer slot to a block, and forgets the block if it was retired and no slot holds it. */
+void MemoryTracer::Unreference(const std::pair<ADDRINT, size_t>& child) {
+    auto live = allocations.find(child.first);
+    if (live != allocations.end() and live->second.generation == child.second) {
+        --live->second.references;
+        return;
+    }
+    auto retired = storedBlocks.find(child.second);
+    if (retired != storedBlocks.end() and --retired->second.references == 0)
+        storedBlocks.erase(retired);
 }
 
-void MemoryTracer::RecordMemoryRead(void* ip, void* addr, uint32_t size, uint32_t tid) {
+/** Finds the lines of 'block' that another thread wrote at other bytes, then forgets its writes.
+ * Writes of two blocks sharing a line are reported with the block that is retired first.
+ */
+void MemoryTracer::CheckFalseSharing(ADDRINT block, const Allocation& allocation) {
+    if (!allocation.size)
+        return;
+    for (ADDRINT line = block / cacheLine; line <= (block + allocation.size - 1) / cacheLine; ++line) {
+        auto found = lines.find(line);
+        if (found == lines.end())
+            continue;
+        std::vector<LineWriter>& writers = found->second.writers;
+
+        bool ours = false, shared = false;
+        std::vector<uint32_t> threads;
+        size_t writes = 0;
+        for (size_t i = 0; i != writers.size(); ++i) {
+            ours |= writers[i].block == block;
+            writes += writers[i].writes;
+            if (std::find(threads.begin(), threads.end(), writers[i].threadId) == threads.end())
+                threads.push_back(writers[i].threadId);
+            for (size_t j = 0; j != i; ++j)
+                shared |= writers[i].threadId != writers[j].threadId and !(writers[i].bytes & writers[j].bytes);
+        }
+        if (ours and shared) {
+            const size_t offset = std::max<ADDRINT>(line * cacheLine, block) - block;
+            FalseSharing& stats = falseSharing[{allocation.site, offset}];
+            ++stats.lines;
+            stats.writes += writes;
+            stats.reads += found->second.reads;
+            if (threads.size() > stats.threads) {
+                stats.threads = threads.size();
+                stats.example = writers;
+            }
+        }
+
+        writers.erase(std::remove_if(writers.begin(), writers.end(), [&](const LineWriter& w) {
+            return w.block == block;
+        }), writers.end());
+        if (writers.empty())
+            lines.erase(found);
+    }
+}
+
+void MemoryTracer::RecordMemoryRead(void* ip, void* addr, uint32_t size, THREADID tid) {
     auto address = reinterpret_cast<uintptr_t>(addr);
     if (!memstats_do_memory_tracing())
         return;
 
-    operations.push_back({address, size, false, tid});
+    // flushed before the access is added, so that a pending pointer store stays in the buffer
+    ThreadData& data = *GetThreadData(tid);
+    if (data.buffer.size() == flushBatch)
+        Flush(data, tid);
+    data.buffer.push_back({address, size, false, tid, 0, mallocCount.load(std::memory_order_relaxed)});
 }
 
-void MemoryTracer::RecordMemoryWrite(void* ip, void* addr, uint32_t size, uint32_t tid) {
+void MemoryTracer::RecordMemoryWrite(void* ip, void* addr, uint32_t size, THREADID tid) {
     auto address = reinterpret_cast<uintptr_t>(addr);
     if (!memstats_do_memory_tracing())
         return;
 
-    operations.push_back({address, size, true, tid});
+    ThreadData& data = *GetThreadData(tid);
+    if (data.buffer.size() == flushBatch)
+        Flush(data, tid);
+    data.buffer.push_back({address, size, true, tid, 0, mallocCount.load(std::memory_order_relaxed)});
+    if (size == sizeof(void*))
+        data.pendingStore = data.buffer.size();
+}
+
+/** Reads the value of the pointer-sized write recorded just before, once the instruction is done. */
+void MemoryTracer::RecordPointerStore(THREADID tid) {
+    ThreadData& data = *GetThreadData(tid);
+    if (!data.pendingStore)
+        return;
+    MemoryOperation& op = data.buffer[data.pendingStore - 1];
+    data.pendingStore = 0;
+    PIN_SafeCopy(&op.value, reinterpret_cast<void*>(op.address), sizeof(op.value));
 }
 
 int main(int argc, char *argv[]) {
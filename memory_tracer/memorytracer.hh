@@ -1,35 +1,194 @@
 #ifndef MEMSTATS_MEMORYTRACER_HH
 #define MEMSTATS_MEMORYTRACER_HH
 
+#include <atomic>
+#include <memory>
 #include <vector>
+#include <map>
 #include <mutex>
+#include <unordered_map>
 
 struct MemoryOperation {
     uintptr_t address;
     size_t size;
     bool isWrite;
     uint32_t threadId;
+    uintptr_t value = 0;         // stored by a pointer-sized write, read once the write is done
+    size_t mallocs = 0;          // blocks recorded when the access was made: later blocks at the address are not hit
 };
 
+/** Block returned by 'malloc', copied out of its allocation for a report. */
 struct MallocOperation {
     void* address;
     size_t size;
+    size_t generation;
+    size_t accesses = 0;
+    size_t misses = 0;           // simulated L1 misses
+};
+
+/** How the accesses to a block followed each other, and how they fared in the simulated caches. */
+struct AccessPattern {
+    size_t accesses = 0;
+    size_t sequential = 0;       // next to, or at, the previous access of the thread
+    size_t strided = 0;          // same distance to the previous access as the one before
+    size_t random = 0;
+    size_t l1Misses = 0;
+    size_t l2Misses = 0;
+};
+
+/** Live block returned by 'malloc', with one bit per byte that was read or written since. */
+struct Allocation {
+    size_t size;
+    ADDRINT site;                // return address of the 'malloc' call
+    size_t generation;           // number of the 'malloc', tells apart blocks reusing an address
+    size_t touched = 0;          // number of bits set
+    std::vector<uint64_t> bits;
+
+    AccessPattern pattern;
+    uint32_t lastThread = ~uint32_t(0);
+    uint32_t lastSize = 0;
+    ADDRINT lastOffset = 0;
+    int64_t lastDelta = 0;
+    int64_t stride = 0;          // majority vote among the strided accesses
+    size_t strideVotes = 0;
+
+    // address and generation of the block stored in each pointer slot, by slot, only for the slots holding one
+    std::unordered_map<size_t, std::pair<ADDRINT, size_t>> children;
+    size_t references = 0;       // pointer slots of live blocks holding the address of this block
+};
+
+/** Retired block whose address is still stored in a live block, kept until no slot holds it. */
+struct StoredBlock {
+    MallocOperation block;
+    size_t references;
+};
+
+/** Block of pointers that the program filled with the addresses of blocks of the same size. */
+struct ArrayOfArrays {
+    MallocOperation parent;      // the pointer array
+    std::vector<MallocOperation> children;
+};
+
+/** Usage of the blocks allocated by one call site, including the ones still alive. */
+struct SiteUsage {
+    size_t allocations = 0;
+    size_t bytes = 0;
+    size_t touched = 0;
+    size_t unused = 0;           // blocks that were never accessed at all
+    size_t unusedBytes = 0;
+    AccessPattern pattern;
+    std::map<int64_t, size_t> strides; // strided accesses by the stride of their block
+};
+
+/** Address ranges around the blocks returned by 'malloc', e.g. the main heap, the arenas of other threads and
+ * large blocks mapped on their own, sorted by address. A published set is never modified, so that a check reads
+ * the bounds of one consistent set.
+ */
+struct HeapRanges {
+    static constexpr size_t capacity = 8;
+    ADDRINT low[capacity] = {};
+    ADDRINT size[capacity] = {}; // 0 for the ranges that are not used
+    size_t count = 0;
+};
+
+/** Set-associative cache with LRU replacement, simulating the caches of a thread. */
+struct CacheLevel {
+    CacheLevel(size_t bytes, size_t ways);
+    bool Access(ADDRINT line);   // whether the line was cached, it is afterwards
+
+    size_t sets;
+    size_t ways;
+    std::vector<ADDRINT> tags;   // 'ways' per set, most recently used first
+};
+
+/** Writes of one thread to one block within a cache line. */
+struct LineWriter {
+    uint32_t threadId;
+    ADDRINT block;
+    ADDRINT site;
+    uint64_t bytes;              // one bit per byte of the line that was written
+    size_t writes;
+};
+
+/** Cache line of 64 bytes that was written in a heap block. */
+struct CacheLine {
+    std::vector<LineWriter> writers;
+    size_t reads = 0;            // reads after the first write
+};
+
+/** Lines falsely shared at the same offset of the blocks of a call site. */
+struct FalseSharing {
+    size_t lines = 0;
+    size_t writes = 0;
+    size_t reads = 0;
+    size_t threads = 0;          // most threads writing to one of the lines
+    std::vector<LineWriter> example;
+};
+
+/** State of one application thread, in a PIN TLS slot, so that recording an access takes no lock:
+ * accesses are buffered and flushed in batches into the shared operations, and a 'malloc' is paired
+ * with its return on the thread that called it.
+ */
+struct ThreadData {
+    std::vector<MemoryOperation> buffer;
+    size_t mallocSize = 0;  // size requested to the outermost 'malloc' running on the thread
+    ADDRINT mallocSite = 0; // and where it was called from
+    CacheLevel l1{32 * 1024, 8};
+    CacheLevel l2{1024 * 1024, 16};
+    size_t pendingStore = 0; // 1 + index in the buffer of a pointer-sized write waiting for its value
+    size_t mallocDepth = 0; // 'malloc' calling 'malloc', e.g. from a hook, is only recorded once
 };
 
 class MemoryTracer {
 public:
     static int Init(int argc, char *argv[]);
     static void Finalize(INT32 code, VOID *v);
-    static const std::vector<MemoryOperation>& GetOperations();
-    static const std::vector<MallocOperation>& GetMallocOperations();
 
-    static std::vector<MallocOperation> mallocOperations;
+    static void RecordMalloc(void* address, size_t size, ADDRINT site, THREADID tid);
+    static void RecordFree(void* address, THREADID tid);
+    static ThreadData* GetThreadData(THREADID tid);
+
+    static std::atomic<size_t> mallocCount; // blocks recorded so far, the generation of the next one
+
+    // ranges of the heap checked for each access, replaced as a whole when a block falls outside of them
+    static std::atomic<const HeapRanges*> heapRanges;
 
 private:
-    static void RecordMemoryRead(void* ip, void* addr, uint32_t size, uint32_t tid);
-    static void RecordMemoryWrite(void* ip, void* addr, uint32_t size, uint32_t tid);
+    static void RecordMemoryRead(void* ip, void* addr, uint32_t size, THREADID tid);
+    static void RecordMemoryWrite(void* ip, void* addr, uint32_t size, THREADID tid);
+    static void RecordPointerStore(THREADID tid);
+    static ADDRINT IsHeapAddress(ADDRINT addr);
+    static void GrowHeapRanges(ADDRINT begin, ADDRINT end);
+
+    static void ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v);
+    static void ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v);
+    static void Flush(ThreadData& data, THREADID tid);
+    static void Touch(const MemoryOperation& op, ThreadData& data);
+    static void TouchPattern(const MemoryOperation& op, Allocation& allocation, ADDRINT first, ADDRINT last);
+    static void TouchLines(const MemoryOperation& op, ADDRINT block, const Allocation& allocation,
+                           ADDRINT first, ADDRINT last);
+    static void Retire(std::map<ADDRINT, Allocation>::iterator it);
+    static MallocOperation Stored(const std::pair<ADDRINT, size_t>& child);
+    static void Unreference(const std::pair<ADDRINT, size_t>& child);
+    static void CheckFalseSharing(ADDRINT block, const Allocation& allocation);
+    static void ReportUsage();
+    static void ReportAccessPatterns();
+    static void ReportArraysOfArrays();
+    static void ReportFalseSharing();
 
-    static std::vector<MemoryOperation> operations;
+    // live allocations by start address, updated with the accesses of each flushed batch
+    static std::map<ADDRINT, Allocation> allocations;
+    static std::map<ADDRINT, SiteUsage> sites;
+    // written cache lines by line number, and the false sharing found in blocks that were retired
+    static std::unordered_map<ADDRINT, CacheLine> lines;
+    static std::map<std::pair<ADDRINT, size_t>, FalseSharing> falseSharing;
+    static std::vector<ArrayOfArrays> arraysOfArrays;
+    // retired blocks still stored in live blocks by generation, to report the arrays of arrays found later
+    static std::unordered_map<size_t, StoredBlock> storedBlocks;
+    static std::vector<ThreadData*> threads;
+    static std::vector<std::unique_ptr<HeapRanges>> heapSnapshots; // every published set, still read by checks
+    static TLS_KEY threadKey;
+    static PIN_LOCK lock; // guards the allocations, call sites, cache lines, stored blocks and threads
 };
 
 /** @brief Enable memory tracing for reads and writes of all memory blocks.
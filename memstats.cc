@@ -1,13 +1,18 @@
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <mutex>
 #include <new>
 #include <sstream>
@@ -17,6 +22,16 @@
 #include <utility>
 #include <vector>
 
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+#if MEMSTATS_PRELOAD
+#include <dlfcn.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#endif
+
 #if __has_include(<version>)
 
 #include <version>
@@ -27,8 +42,39 @@
 #include <stacktrace>
 #endif
 
-#if MEMSTAT_HAVE_TBB
-#include <oneapi/tbb/concurrent_vector.h>
+#if defined(__GNUC__) && __has_include(<unwind.h>)
+#define MEMSTAT_HAVE_UNWIND 1
+#include <unwind.h>
+#endif
+
+#if __has_include(<dlfcn.h>) && __has_include(<cxxabi.h>)
+#define MEMSTAT_HAVE_DLADDR 1
+#include <cxxabi.h>
+#include <dlfcn.h>
+#endif
+
+// stacks are captured with the unwinder and named with 'dladdr', or with 'std::stacktrace'
+#if MEMSTAT_HAVE_STACKTRACE || (MEMSTAT_HAVE_UNWIND && MEMSTAT_HAVE_DLADDR)
+#define MEMSTAT_HAVE_STACKS 1
+#endif
+
+#if !defined(_WIN32) && __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#define MEMSTAT_HAVE_MMAP 1
+#define MEMSTAT_HAVE_TRACE 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && __has_include(<x86intrin.h>) && \
+    __has_include(<cpuid.h>)
+#define MEMSTAT_HAVE_TSC 1
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#if __has_include(<time.h>)
+#include <time.h>
 #endif
 
 #if __cpp_constinit >= 201907L
@@ -37,7 +83,80 @@
 #define MEMSTATS_CONSTINIT
 #endif
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define MEMSTATS_NOINLINE __declspec(noinline)
+#define MEMSTATS_RETURN_ADDRESS() _ReturnAddress()
+#else
+#define MEMSTATS_NOINLINE __attribute__((noinline))
+#define MEMSTATS_RETURN_ADDRESS() __builtin_return_address(0)
+#endif
+
 #include "memstats.hh"
+#include "memstats_analysis.hh"
+#include "memstats_format.hh"
+
+#if MEMSTAT_HAVE_TRACE
+#include "memstats_trace.hh"
+#endif
+
+#if MEMSTATS_PRELOAD
+// the C allocator is interposed at the end of this file, so the library itself allocates from glibc directly
+extern "C" {
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t count, std::size_t size);
+void *__libc_realloc(void *ptr, std::size_t size);
+void *__libc_memalign(std::size_t alignment, std::size_t size);
+void *__libc_valloc(std::size_t size);
+void *__libc_pvalloc(std::size_t size);
+void __libc_free(void *ptr);
+}
+#endif
+
+void *memstats_raw_malloc(std::size_t size) {
+#if MEMSTATS_PRELOAD
+    return __libc_malloc(size);
+#else
+    return std::malloc(size);
+#endif
+}
+
+void *memstats_raw_calloc(std::size_t count, std::size_t size) {
+#if MEMSTATS_PRELOAD
+    return __libc_calloc(count, size);
+#else
+    return std::calloc(count, size);
+#endif
+}
+
+void memstats_raw_free(void *ptr) {
+#if MEMSTATS_PRELOAD
+    __libc_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
+// allocations of over-aligned memory, e.g. for aligned 'new' or the event chunks
+void *memstats_aligned_malloc(std::size_t alignment, std::size_t size) {
+#if MEMSTATS_PRELOAD
+    return __libc_memalign(alignment, size);
+#elif defined(_WIN32)
+    return _aligned_malloc(size, alignment);
+#else
+    // 'aligned_alloc' requires the size to be a multiple of the alignment
+    alignment = std::max(alignment, sizeof(void *));
+    return ::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+}
+
+void memstats_aligned_free(void *ptr) {
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    memstats_raw_free(ptr);
+#endif
+}
 
 // all allocations within this library need to use malloc/free instad of new/delete
 template<class T>
@@ -57,14 +176,14 @@ public:
         if (n > this->max_size())
             throw std::bad_alloc();
 
-        T *ret = static_cast<T *>(std::malloc(n * sizeof(T)));
+        T *ret = static_cast<T *>(memstats_raw_malloc(n * sizeof(T)));
         if (!ret)
             throw std::bad_alloc();
         return ret;
     }
 
     void deallocate(T *p, std::size_t) {
-        std::free(p);
+        memstats_raw_free(p);
     }
 
     std::size_t max_size() const noexcept {
@@ -80,6 +199,12 @@ public:
     }
 };
 
+template<class Key, class T>
+using unordered_map = std::unordered_map<Key, T, std::hash<Key>, std::equal_to<Key>, MallocAllocator<std::pair<const Key
+    , T> > >;
+using string = std::basic_string<char, std::char_traits<char>, MallocAllocator<char> >;
+using stringstream = std::basic_stringstream<char, std::char_traits<char>, MallocAllocator<char> >;
+
 #if MEMSTATS_USE_MEMORY_TRACER
 void __attribute__((optimize("O0"))) disable_memory_tracer(void) {
 }
@@ -102,13 +227,15 @@ public:
 struct MemStatsInfo {
     const void *ptr = nullptr;
     std::size_t size = 0;
-    std::chrono::high_resolution_clock::time_point time = {};
+    std::uint64_t time = 0;     // ticks of 'memstats_clock'
     std::thread::id thread = {};
-#if MEMSTAT_HAVE_STACKTRACE
-    std::basic_stacktrace<MallocAllocator<std::stacktrace_entry>> stacktrace;
-#endif
+    std::size_t alignment = 0; // requested alignment, 0 if default
+    unsigned char form = 0;    // 'MemStatsForm' flags of the operator that produced the event
+    std::uint16_t region = 0;  // id of the innermost region of the thread, 0 if none
+    std::uint32_t stack = 0;   // id of the interned stack, 0 if none
 
-    static void record(void *ptr, std::size_t sz = 0);
+    static void record(void *ptr, std::size_t sz = 0, std::size_t alignment = 0, unsigned char form = 0,
+                       const void *caller = nullptr);
 };
 
 bool init_memstats_instrumentation_thread() {
@@ -127,6 +254,61 @@ bool init_memstats_instrumentation_thread() {
     return false;
 }
 
+// Whether to store every event until it is reported, or only to keep running counters per thread
+enum class MemStatsMode { events, aggregate };
+
+MemStatsMode init_memstats_mode() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    if (char *ptr = std::getenv("MEMSTATS_MODE")) {
+        if (std::strcmp(ptr, "events") == 0)
+            return MemStatsMode::events;
+        if (std::strcmp(ptr, "aggregate") == 0)
+            return MemStatsMode::aggregate;
+        std::cerr << "Option 'MEMSTATS_MODE=" << ptr
+                << "' not known. Fallback on default 'events'\n";
+    }
+    return MemStatsMode::events;
+}
+
+// Mean number of bytes between two sampled allocations, 0 to record every allocation
+std::size_t init_memstats_sample_rate() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    if (const char *ptr = std::getenv("MEMSTATS_SAMPLE_RATE")) {
+        try {
+            return std::stoull(ptr);
+        } catch (...) {
+            std::cerr << "Option 'MEMSTATS_SAMPLE_RATE=" << ptr << "' not known. Fallback on default '0'\n";
+        }
+    }
+    return 0;
+}
+
+// How reports are written: text with histograms, or for other programs, one JSON object or CSV rows per report
+enum class MemStatsReportFormat { text, json, csv };
+
+MemStatsReportFormat init_memstats_report_format() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    if (char *ptr = std::getenv("MEMSTATS_REPORT_FORMAT")) {
+        if (std::strcmp(ptr, "text") == 0)
+            return MemStatsReportFormat::text;
+        if (std::strcmp(ptr, "json") == 0)
+            return MemStatsReportFormat::json;
+        if (std::strcmp(ptr, "csv") == 0)
+            return MemStatsReportFormat::csv;
+        std::cerr << "Option 'MEMSTATS_REPORT_FORMAT=" << ptr << "' not known. Fallback on default 'text'\n";
+    }
+    return MemStatsReportFormat::text;
+}
+
 /** NOTE: initialization order fiasco on the sight!
  * The operator 'new' and 'delete' are automatically exposed to the whole program and
  * dynamic-initializtion of other global variables may be interleaved with the ones defined here.
@@ -141,382 +323,2399 @@ bool init_memstats_instrumentation_thread() {
 
 static std::recursive_mutex memstats_lock = {};
 
-#if MEMSTAT_HAVE_TBB
-// Non-'constinit' is problematic because its initialization cannot be done as constant-initialization
-// and a call to 'new' during dynamic-initialization in another library may try to write to this variable even before its initialized.
-/*MEMSTATS_CONSTINIT*/ tbb::concurrent_vector<MemStatsInfo, MallocAllocator<MemStatsInfo>> memstats_events = {};
-#else
-// 'constinit' is good because it will be initialized before any dynamic-initialization happens
-#if __cpp_lib_constexpr_vector >= 201907L
-MEMSTATS_CONSTINIT
-#endif
-static std::vector<MemStatsInfo, MallocAllocator<MemStatsInfo> > memstats_events = {};
-#endif
-std::mutex memstats_events_mutex;
+static MemStatsMode memstats_mode = init_memstats_mode();
+static std::size_t memstats_sample_rate = init_memstats_sample_rate();
+static MemStatsReportFormat memstats_report_format = init_memstats_report_format();
 
+/** Source of the timestamps of events, read on every recorded allocation and free:
+ * 'tsc' reads the time-stamp counter of the processor, 'coarse' a monotonic clock updated once per
+ * scheduler tick, 'steady' the 'std::chrono::steady_clock', and 'none' takes no timestamp at all.
+ */
+enum class MemStatsClock { steady, tsc, coarse, none };
 
-// Zero- and dynamic-initialization of a thread-local variable does not necessarily happen on any order related to the global ones
-static thread_local bool memstats_instrumentation_thread = init_memstats_instrumentation_thread();
+// whether the time-stamp counter ticks at a constant rate, synchronized between cores
+bool memstats_invariant_tsc() {
+#if MEMSTAT_HAVE_TSC
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) and (edx & (1u << 8));
+#else
+    return false;
+#endif
+}
 
-// guard thread-local variable to instrument further delets at exit
-bool init_memstats_instrumentation_thread_guard() {
+MemStatsClock init_memstats_clock() {
 #if MEMSTATS_USE_MEMORY_TRACER
     const MemoryTracerGuard guard;
 #endif
 
-    std::atexit([] { memstats_instrumentation_thread = false; });
-    return true;
+    const bool tsc = memstats_invariant_tsc();
+    const MemStatsClock fallback = tsc ? MemStatsClock::tsc : MemStatsClock::steady;
+    if (const char *ptr = std::getenv("MEMSTATS_CLOCK")) {
+        if (std::strcmp(ptr, "steady") == 0)
+            return MemStatsClock::steady;
+        if (std::strcmp(ptr, "tsc") == 0 and tsc)
+            return MemStatsClock::tsc;
+#if defined(CLOCK_MONOTONIC_COARSE)
+        if (std::strcmp(ptr, "coarse") == 0)
+            return MemStatsClock::coarse;
+#endif
+        if (std::strcmp(ptr, "none") == 0)
+            return MemStatsClock::none;
+        std::cerr << "Option 'MEMSTATS_CLOCK=" << ptr << "' not known. Fallback on default '"
+                << (tsc ? "tsc" : "steady") << "'\n";
+    }
+    return fallback;
 }
 
-const static thread_local bool memstats_instrumentation_thread_guard = init_memstats_instrumentation_thread_guard();
+static MemStatsClock memstats_clock = init_memstats_clock();
 
-// We need to make absolutely sure this is constinit so that 'memstats_instrumentation_global' is const-initialized,
-// otherwise threads will try to syncronize with an uninitialized variable
-#if MEMSTAT_ATOMIC_CONSTEXPR
-MEMSTATS_CONSTINIT static std::atomic<bool> memstats_instrumentation_global{false};
-#else
-#error "MemStats needs a conforming C++ standard library where 'std::atomic<bool>' can be const-initialized, i.e. its constructor is 'constexpr'!"
+// timestamp of an event, in ticks of 'memstats_clock'
+inline std::uint64_t memstats_now() {
+    switch (memstats_clock) {
+#if MEMSTAT_HAVE_TSC
+        case MemStatsClock::tsc:
+            return __rdtsc();
 #endif
-
-bool init_memstats_instrumentation_guard() {
-#if MEMSTATS_USE_MEMORY_TRACER
-    const MemoryTracerGuard guard;
+#if defined(CLOCK_MONOTONIC_COARSE)
+        case MemStatsClock::coarse: {
+            timespec now;
+            ::clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+            return std::uint64_t(now.tv_sec) * 1000000000u + std::uint64_t(now.tv_nsec);
+        }
 #endif
-
-    bool instrument = false;
-    // Note this variable is const-initialized to false. Here we change it to true and syncronize other threads during dynamic initialization
-    if (char *ptr = std::getenv("MEMSTATS_ENABLE_INSTRUMENTATION")) {
-        if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
-            instrument = true;
-        else if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
-            instrument = false;
-        else
-            std::cerr << "Option 'MEMSTATS_ENABLE_INSTRUMENTATION=" << ptr
-                    << "' not known. Fallback on default 'false'\n";
+        case MemStatsClock::none:
+            return 0;
+        default:
+            return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
     }
-    memstats_instrumentation_global.store(instrument, std::memory_order_release);
-    return instrument;
 }
 
-// Const-initialization (happens before dynamic-initialization) assigns 'false' to 'memstats_instrumentation_global' which is fine because no instrumentation will be done, and 'memstats_events' won't be called.
-// By defining 'memstats_instrumentation_global' after 'memstats_events' we guarantee that they are initialized on that order during dynamic-initialization.
-// meaning that we cannot register memory events before 'memstats_events' is initialized.
-// Note that we do not want this variable to be const-initialized to 'true' before dynamic-initialization, so we make sure this gets
-// dynamic-initialized in the correct order by delaying its initialization by a non-constexpr function.
-static bool memstats_instrumentation_guard = init_memstats_instrumentation_guard();
+// nanoseconds per tick of 'memstats_clock', 0 until the first duration is converted
+MEMSTATS_CONSTINIT static std::atomic<double> memstats_ns_per_tick{0};
 
-bool init_memstats_at_exit() {
-#if MEMSTATS_USE_MEMORY_TRACER
-    const MemoryTracerGuard guard;
-#endif
+/** Calibrates the time-stamp counter once against 'std::chrono::steady_clock', over 1ms. Only runs when a
+ * duration is first needed, so that processes which never record pay nothing at start-up.
+ */
+MEMSTATS_NOINLINE double memstats_calibrate_ns_per_tick() {
+    static std::once_flag calibrate_flag;
+    std::call_once(calibrate_flag, [] {
+        double ns_per_tick = 1.;
+        if (memstats_clock == MemStatsClock::tsc) {
+            const auto begin = std::chrono::steady_clock::now();
+            const std::uint64_t ticks_begin = memstats_now();
+            auto end = begin;
+            while (end - begin < std::chrono::milliseconds(1))
+                end = std::chrono::steady_clock::now();
+            const std::uint64_t ticks = memstats_now() - ticks_begin;
+            const double ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+            if (ticks)
+                ns_per_tick = ns / double(ticks);
+        }
+        memstats_ns_per_tick.store(ns_per_tick, std::memory_order_release);
+    });
+    return memstats_ns_per_tick.load(std::memory_order_acquire);
+}
 
-    static std::once_flag report_flag;
-    std::call_once(report_flag,
-                   [] {
-                       std::atexit([] {
-                           memstats_instrumentation_global.store(false, std::memory_order_release);
-                           bool do_report_at_exit = true;
-                           if (char *ptr = std::getenv("MEMSTATS_REPORT_AT_EXIT")) {
-                               if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
-                                   do_report_at_exit = true;
-                               else if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
-                                   do_report_at_exit = false;
-                               else
-                                   std::cerr << "Option 'MEMSTATS_REPORT_AT_EXIT=" << ptr
-                                           << "' not known. Fallback on default 'true'\n";
-                           }
-                           if (do_report_at_exit)
-                               memstats_report("default");
-                       });
-                   });
+// duration of 'ticks' of 'memstats_clock' in nanoseconds
+inline double memstats_ticks_to_ns(std::uint64_t ticks) {
+    double ns_per_tick = memstats_ns_per_tick.load(std::memory_order_acquire);
+    if (!ns_per_tick)
+        ns_per_tick = memstats_calibrate_ns_per_tick();
+    return double(ticks) * ns_per_tick;
+}
+
+/** Sampling as in tcmalloc/jemalloc heap profiling: allocated bytes are modeled as a Poisson process with one
+ * sample every 'memstats_sample_rate' bytes on average. Each thread counts down the bytes left until the next
+ * sample, so an allocation that is not sampled only costs a decrement and a branch.
+ */
+MEMSTATS_CONSTINIT static thread_local std::int64_t memstats_sample_countdown = 0;
+MEMSTATS_CONSTINIT static thread_local std::uint64_t memstats_sample_state = 0;
+
+// exponentially distributed number of bytes until the next sample
+std::int64_t memstats_sample_interval() {
+    // xorshift64*
+    std::uint64_t &x = memstats_sample_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    const double uniform = double((x * 0x2545F4914F6CDD1Dull) >> 11) / double(std::uint64_t(1) << 53);
+    return static_cast<std::int64_t>(-std::log1p(-uniform) * double(memstats_sample_rate)) + 1;
+}
+
+bool memstats_sample_slow(std::size_t sz) {
+    // without sampling the countdown never becomes positive, and every allocation is recorded
+    if (!memstats_sample_rate)
+        return true;
+    if (!memstats_sample_state) {
+        // first allocation of the thread: seed the generator and start the countdown
+        memstats_sample_state = (std::hash<std::thread::id>{}(std::this_thread::get_id()) ^
+                                 std::uint64_t(std::chrono::steady_clock::now().time_since_epoch().count())) | 1;
+        memstats_sample_countdown = memstats_sample_interval() - static_cast<std::int64_t>(sz);
+        if (memstats_sample_countdown > 0)
+            return false;
+    }
+    memstats_sample_countdown = memstats_sample_interval();
     return true;
 }
 
-// Destruction order fiasco also hits here. If a variable destroyed during dynamic-initialization-destruction (reverse order),
-// calls on 'delete' or direct accesses to 'memstats_events' may trigger an access to an already destroyed 'memstats_events'.
-// Therefore, we make sure to make a 'report' before 'memstats_events' is destroyed.
-static const bool memstats_at_exit_guard = init_memstats_at_exit();
+bool memstats_sample(std::size_t sz) {
+    if ((memstats_sample_countdown -= static_cast<std::int64_t>(sz)) > 0)
+        return false;
+    return memstats_sample_slow(sz);
+}
 
-/** Overview of initialization/destruction order:
- * memstats_instrumentation_global = false;                                                     // const-initialization
- * memstats_lock = {};                                                                          // dynamic-initialization
- * memstats_events = {};                                                                        // dynamic-initialization
- * init_memstats_instrumentation_guard(); -> memstats_instrumentation_global = true;            // dynamic-initialization
- * memstats_at_exit_guard = init_memstats_at_exit();                                    // dynamic-initialization
- * main();
- * memstats_instrumentation_global = false;
- * std::atexit(default_report); -> read memstats_events                                         // dynamic-initialization-destruction
- * memstats_events.~vector<MemStatsInfo, MallocAllocator<MemStatsInfo>>();                      // dynamic-initialization-destruction
- * memstats_lock.~mutex();                                                                      // dynamic-initialization-destruction
- */
+// inverse of the probability for an allocation of 'sz' bytes to be sampled, i.e. the number of allocations it stands for
+double memstats_sample_weight(std::size_t sz) {
+    if (!memstats_sample_rate)
+        return 1.;
+    return -1. / std::expm1(-double(sz) / double(memstats_sample_rate));
+}
 
-// bin representation of percentage from 0% to 100%
-static const std::array<const char *, 4> memstats_str_precentage_punctuation{" ", ".", ":", "!"};
-static const std::array<const char *, 4> memstats_str_precentage_circle{" ", ".", "o", "O"};
-static const std::array<const char *, 5> memstats_str_precentage_shadow{" ", "░", "▒", "▓", "█"};
-static const std::array<const char *, 5> memstats_str_precentage_wire{" ", "-", "~", "=", "#"};
-static const std::array<const char *, 9> memstats_str_precentage_box{" ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
-static const std::array<const char *, 10> memstats_str_precentage_number{
-    "0", "1", "2", "3", "4", "5", "6", "7", "8",
-    "9"
-};
+/** Stacks are captured as raw return addresses and interned into a global table, so that an event only
+ * stores the 32-bit id of its stack. The table is an open-addressing hash table of immutable stacks:
+ * a new stack is published with a single compare-and-swap on an empty slot, and slots are never emptied,
+ * so recording threads look up and insert stacks without a lock. Frames are resolved to names only when
+ * reported, once per distinct return address.
+ * Where full stacks cannot be captured, the table interns the call site alone, as a stack of depth 1.
+ */
+constexpr std::size_t memstats_stack_max_depth = 64;
 
-std::pair<char const *const *, std::size_t> memstats_str_hist_representation() {
-#if MEMSTATS_USE_MEMORY_TRACER
-    const MemoryTracerGuard guard;
+struct MemStatsStack {
+    std::uint64_t hash;
+    std::uint32_t id;
+    std::uint32_t depth;
+#if MEMSTAT_HAVE_STACKTRACE
+    // the first capture of the stack, which knows the function and source line of each frame
+    std::basic_stacktrace<MallocAllocator<std::stacktrace_entry> > representative;
 #endif
 
-    if (const char *ptr = std::getenv("MEMSTATS_HISTOGRAM_REPRESENTATION")) {
-        if (std::strcmp(ptr, "box") == 0)
-            return std::make_pair(memstats_str_precentage_box.data(), memstats_str_precentage_box.size());
-        if (std::strcmp(ptr, "number") == 0)
-            return std::make_pair(memstats_str_precentage_number.data(), memstats_str_precentage_number.size());
-        if (std::strcmp(ptr, "punctuation") == 0)
-            return std::make_pair(memstats_str_precentage_punctuation.data(),
-                                  memstats_str_precentage_punctuation.size());
-        if (std::strcmp(ptr, "shadow") == 0)
-            return std::make_pair(memstats_str_precentage_shadow.data(), memstats_str_precentage_shadow.size());
-        if (std::strcmp(ptr, "wire") == 0)
-            return std::make_pair(memstats_str_precentage_wire.data(), memstats_str_precentage_wire.size());
-        if (std::strcmp(ptr, "circle") == 0)
-            return std::make_pair(memstats_str_precentage_circle.data(), memstats_str_precentage_circle.size());
-        std::cerr << "Option 'MEMSTATS_HISTOGRAM_REPRESENTATION=" << ptr << "' not known. Fallback on default 'box'\n";
+    // 'depth' return addresses from the innermost frame, stored past the end of the struct
+    std::uintptr_t *frames() {
+        return reinterpret_cast<std::uintptr_t *>(this + 1);
     }
-    return std::make_pair(memstats_str_precentage_box.data(), memstats_str_precentage_box.size());
-}
 
-unsigned short memstats_bins() {
-#if MEMSTATS_USE_MEMORY_TRACER
-    const MemoryTracerGuard guard;
-#endif
+    const std::uintptr_t *frames() const {
+        return reinterpret_cast<const std::uintptr_t *>(this + 1);
+    }
+};
 
-    if (const char *ptr = std::getenv("MEMSTATS_BINS")) {
-        try {
-            return std::stoi(ptr);
-        } catch (...) {
-            std::cerr << "Option 'MEMSTATS_BINS=" << ptr << "' not known. Fallback on default '15'\n";
-        }
+// 'capacity' slots followed by 'capacity' stacks by id, stored past the end of the struct
+struct MemStatsStackTable {
+    std::atomic<std::uint32_t> count;
+    std::size_t capacity;
+
+    std::atomic<MemStatsStack *> *slots() {
+        return reinterpret_cast<std::atomic<MemStatsStack *> *>(this + 1);
     }
-    return 15;
-}
 
-void MemStatsInfo::record(void *ptr, std::size_t sz) {
+    std::atomic<MemStatsStack *> *by_id() {
+        return slots() + capacity;
+    }
+};
+
+// What to capture of each event: nothing, the return address of the allocation function, or the whole stack
+enum class MemStatsStacks { off, caller, full };
+
+MemStatsStacks init_memstats_stacks() {
 #if MEMSTATS_USE_MEMORY_TRACER
     const MemoryTracerGuard guard;
 #endif
 
-    auto time = std::chrono::high_resolution_clock::now();
-    MemStatsInfo info;
-    info.ptr = ptr;
-    info.size = sz;
-    info.time = time;
-    info.thread = std::this_thread::get_id();
 #if MEMSTAT_HAVE_STACKTRACE
-    info.stacktrace = info.stacktrace.current(2);
+    const MemStatsStacks fallback = MemStatsStacks::full;
+#else
+    const MemStatsStacks fallback = MemStatsStacks::caller;
 #endif
-#if !MEMSTAT_HAVE_TBB
-    std::unique_lock<std::recursive_mutex> lk{memstats_lock};
+    if (char *ptr = std::getenv("MEMSTATS_STACKS")) {
+#if MEMSTAT_HAVE_STACKS
+        if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
+            return MemStatsStacks::full;
 #endif
-    memstats_events.emplace_back(std::move(info));
+        if (std::strcmp(ptr, "caller") == 0)
+            return MemStatsStacks::caller;
+        if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
+            return MemStatsStacks::off;
+        std::cerr << "Option 'MEMSTATS_STACKS=" << ptr << "' not known. Fallback on default '"
+                << (fallback == MemStatsStacks::full ? "true" : "caller") << "'\n";
+    }
+    return fallback;
 }
 
-template<class Key, class T>
-using unordered_map = std::unordered_map<Key, T, std::hash<Key>, std::equal_to<Key>, MallocAllocator<std::pair<const Key
-    , T> > >;
-using string = std::basic_string<char, std::char_traits<char>, MallocAllocator<char> >;
-using stringstream = std::basic_stringstream<char, std::char_traits<char>, MallocAllocator<char> >;
+static MemStatsStacks memstats_stacks = init_memstats_stacks();
 
-void print_legend() {
+std::size_t init_memstats_stack_capacity() {
 #if MEMSTATS_USE_MEMORY_TRACER
     const MemoryTracerGuard guard;
 #endif
 
-    std::cout << "\nMemStats Legend:\n\n";
-    std::cout << "  [{hist}]{max} | {accum}({count}) | {pos}\n\n";
-    std::cout << "• hist:   Distribution of number of 'new' allocations for a given number of bytes\n";
-    std::cout << "• max:    Maximum allocation requested to 'new'\n";
-    std::cout << "• accum:  Accumulated number of bytes requested\n";
-    std::cout << "• count:  Number of total allocation requests\n";
-    std::cout << "• pos:    Position of the measurment\n";
-    std::cout << "\nMemStats Histogram Legend:\n\n";
-    const auto str_precentage = memstats_str_hist_representation();
-    string buffer;
-    double per_width = 100. / str_precentage.second;
-    for (std::size_t i = 0; i != str_precentage.second; ++i)
-        std::cout << "• \'" << str_precentage.first[i] << "\' -> [" << std::fixed
-                << std::setw(4) << std::setprecision(1) << i * per_width
-                << "%, " << std::setw(5) << (i + 1) * per_width << '%'
-                << (i + 1 == str_precentage.second ? ']' : ')') << std::endl;
+    const std::size_t fallback = std::size_t(1) << 20;
+    if (const char *ptr = std::getenv("MEMSTATS_STACK_CAPACITY")) {
+        char *end = nullptr;
+        const unsigned long long capacity = std::strtoull(ptr, &end, 10);
+        if (end != ptr and !*end and capacity >= 2 and capacity <= std::uint32_t(-1)) {
+            // rounded up to a power of two, so that slots are found with a mask
+            std::size_t rounded = 2;
+            while (rounded < capacity)
+                rounded <<= 1;
+            return rounded;
+        }
+        std::cerr << "Option 'MEMSTATS_STACK_CAPACITY=" << ptr << "' not known. Fallback on default '" << fallback
+                << "'\n";
+    }
+    return fallback;
 }
 
-void report_memory_leaks() {
-    std::cout << "\nMemory leaks:\n";
+// Maximum number of distinct stacks, the table holds two pointers per stack
+static std::size_t memstats_stack_capacity = init_memstats_stack_capacity();
+
+// Allocated by the first event that interns a stack, since most processes linking the library never record
+MEMSTATS_CONSTINIT static std::atomic<MemStatsStackTable *> memstats_stack_table{nullptr};
+
+// the stack table, allocated on first use, or nullptr if it cannot be allocated
+MemStatsStackTable *memstats_get_stack_table() {
+    MemStatsStackTable *table = memstats_stack_table.load(std::memory_order_acquire);
+    if (table or memstats_stacks == MemStatsStacks::off)
+        return table;
+    // zero-filled pages are only backed by memory once they are touched
+    void *ptr = memstats_raw_calloc(1, sizeof(MemStatsStackTable) +
+                                       2 * memstats_stack_capacity * sizeof(std::atomic<MemStatsStack *>));
+    if (!ptr)
+        return nullptr;
+    MemStatsStackTable *created = static_cast<MemStatsStackTable *>(ptr);
+    created->capacity = memstats_stack_capacity;
+    if (memstats_stack_table.compare_exchange_strong(table, created, std::memory_order_acq_rel))
+        return created;
+    // another thread allocated it first
+    memstats_raw_free(ptr);
+    return table;
+}
 
-    // Report allocations without deallocations
-    for (int i = 0; i < memstats_events.size(); ++i) {
-        // Skip deallocations (only allocations can have size > 0)
-        if (memstats_events[i].size == 0) continue;
-        bool freed = false;
-        for (int j = i + 1; j < memstats_events.size(); ++j) {
-            if (memstats_events[i].ptr == memstats_events[j].ptr && memstats_events[j].size == 0 &&
-                memstats_events[i].thread == memstats_events[j].thread) {
-                freed = true;
+std::uint64_t memstats_hash_frames(const std::uintptr_t *frames, std::size_t depth) {
+    std::uint64_t hash = depth;
+    for (std::size_t i = 0; i != depth; ++i)
+        hash = (hash ^ frames[i]) * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 32);
+}
+
+// new stack with a copy of 'frames', not in the table yet, or nullptr if the table is full
+MemStatsStack *memstats_create_stack(MemStatsStackTable &table, std::uint64_t hash, const std::uintptr_t *frames,
+                                     std::size_t depth) {
+    // the count stops at the capacity, so that misses on a full table never wrap it around to ids in use
+    std::uint32_t count = table.count.load(std::memory_order_relaxed);
+    do {
+        if (std::size_t(count) + 1 >= table.capacity)
+            return nullptr;
+    } while (!table.count.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+    const std::uint32_t id = count + 1;
+    void *ptr = memstats_raw_malloc(sizeof(MemStatsStack) + depth * sizeof(std::uintptr_t));
+    if (!ptr)
+        return nullptr;
+    MemStatsStack *stack = ::new(ptr) MemStatsStack{};
+    stack->hash = hash;
+    stack->id = id;
+    stack->depth = static_cast<std::uint32_t>(depth);
+    std::copy(frames, frames + depth, stack->frames());
+    return stack;
+}
+
+/** Id of the stack 'frames' in the table. If it is not there, 'created' is published in its place and 'inserted'
+ * is set, or 0 is returned if 'created' is nullptr. 'created' is destroyed if another thread published it first.
+ */
+std::uint32_t memstats_probe_stack(MemStatsStackTable &table, std::uint64_t hash, const std::uintptr_t *frames,
+                                   std::size_t depth, MemStatsStack *created, bool &inserted) {
+    const std::size_t mask = table.capacity - 1;
+    for (std::size_t i = hash & mask, probes = 0; probes != table.capacity; i = (i + 1) & mask, ++probes) {
+        MemStatsStack *stack = table.slots()[i].load(std::memory_order_acquire);
+        if (!stack) {
+            if (!created)
+                return 0;
+            if (table.slots()[i].compare_exchange_strong(stack, created, std::memory_order_acq_rel)) {
+                table.by_id()[created->id].store(created, std::memory_order_release);
+                inserted = true;
+                return created->id;
             }
+            // another thread inserted a stack in this slot first, it may be the same one
         }
-
-        if (!freed) {
-            std::cout << "Pointer " << memstats_events[i].ptr << " was never freed in Thread "
-                    << memstats_events[i].thread << "." << std::endl;
-#if MEMSTAT_HAVE_STACKTRACE
-            std::cout << "Current stacktrace:\n" << memstats_events[i].stacktrace << std::endl;
-#endif
+        if (stack->hash == hash and stack->depth == depth and std::equal(frames, frames + depth, stack->frames())) {
+            if (created) {
+                created->~MemStatsStack();
+                memstats_raw_free(created);
+            }
+            return stack->id;
         }
     }
+    if (created) {
+        created->~MemStatsStack();
+        memstats_raw_free(created);
+    }
+    return 0;
 }
 
-void memstats_report(const char *report_name) {
-#if MEMSTATS_USE_MEMORY_TRACER
-    const MemoryTracerGuard guard;
-#endif
+// id of the stack made of the call site 'caller' alone, or 0 if the table is full
+std::uint32_t memstats_intern_caller(const void *caller, bool &inserted) {
+    const std::uintptr_t frame = reinterpret_cast<std::uintptr_t>(caller);
+    MemStatsStackTable *table = memstats_get_stack_table();
+    if (!frame or !table)
+        return 0;
+    const std::uint64_t hash = memstats_hash_frames(&frame, 1);
+    if (const std::uint32_t id = memstats_probe_stack(*table, hash, &frame, 1, nullptr, inserted))
+        return id;
+    MemStatsStack *created = memstats_create_stack(*table, hash, &frame, 1);
+    return created ? memstats_probe_stack(*table, hash, &frame, 1, created, inserted) : 0;
+}
 
-    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
-    if (memstats_events.size() == 0)
-        return;
+#if MEMSTAT_HAVE_UNWIND
+struct MemStatsUnwindState {
+    std::uintptr_t *frames;
+    std::size_t skip;
+    std::size_t depth;
+};
 
-    std::cout << "\n------------------- MemStats " << report_name << " -------------------\n";
-    struct Stats {
-        std::size_t count{0}, size{0}, max_size{0};
-        unordered_map<std::size_t, std::size_t> size_freq;
-    };
-    Stats global_stats;
-    unordered_map<std::thread::id, Stats> thread_stats;
-    unordered_map<const void *, unordered_map<std::thread::id, std::pair<int, bool> > > ptr_collec;
-    struct PtrStats {
-        int times_freed;
-        const void *ptr;
-    };
-    std::vector<PtrStats> ptr_stats;
-#if MEMSTAT_HAVE_STACKTRACE
-    unordered_map<std::basic_stacktrace<MallocAllocator<std::stacktrace_entry>>, Stats> stacktrace_stats;
-    unordered_map<std::stacktrace_entry, Stats> stacktrace_entry_stats;
+_Unwind_Reason_Code memstats_unwind_frame(struct _Unwind_Context *context, void *arg) {
+    MemStatsUnwindState &state = *static_cast<MemStatsUnwindState *>(arg);
+    if (state.skip) {
+        --state.skip;
+        return _URC_NO_REASON;
+    }
+    const std::uintptr_t address = _Unwind_GetIP(context);
+    if (!address or state.depth == memstats_stack_max_depth)
+        return _URC_END_OF_STACK;
+    state.frames[state.depth++] = address;
+    return _URC_NO_REASON;
+}
 #endif
 
-    for (const MemStatsInfo &info: memstats_events) {
-        auto register_stats = [&](Stats &stats) {
-            if (info.size)
-                ++stats.count;
-            stats.size += info.size;
-            stats.max_size = std::max(stats.max_size, info.size);
-            if (info.size)
-                ++stats.size_freq[info.size];
-        };
-
-        register_stats(global_stats);
-        register_stats(thread_stats[info.thread]);
+#if MEMSTAT_HAVE_STACKS
+/** Number of frames of 'frames' inside the library, i.e. before the call site 'caller' of the allocation function,
+ * or 0 if 'caller' is not among them. Frames of 'std::stacktrace' may point one byte before the return address.
+ */
+std::size_t memstats_library_frames(const std::uintptr_t *frames, std::size_t depth, const void *caller) {
+    const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(caller);
+    for (std::size_t i = 0; address and i != depth; ++i)
+        if (frames[i] == address or frames[i] + 1 == address)
+            return i;
+    return 0;
+}
 
-        if (ptr_collec[info.ptr][info.thread].second && info.size > 0) {
-            PtrStats stats = {ptr_collec[info.ptr][info.thread].first, info.ptr};
-            ptr_stats.push_back(stats);
-            ptr_collec[info.ptr][info.thread].first = 0;
-            ptr_collec[info.ptr][info.thread].second = false;
-        } else if (info.size == 0) {
-            ++ptr_collec[info.ptr][info.thread].first;
-            ptr_collec[info.ptr][info.thread].second = true;
-        }
+/** Id of the stack of the caller, skipping 'skip' frames above this function, or 0 if the table is full.
+ * The stack starts at the call site 'caller' of the allocation function, whichever allocation function and
+ * recording functions of the library are in between, so that sites are the same as with 'MEMSTATS_STACKS=caller'.
+ * 'inserted' is set when the stack is seen for the first time.
+ * Not inlined: frames are counted from here, and both ways of capturing must see the same frames.
+ */
+MEMSTATS_NOINLINE std::uint32_t memstats_intern_stack(std::size_t skip, const void *caller, bool &inserted) {
+    MemStatsStackTable *table = memstats_get_stack_table();
+    if (!table)
+        return 0;
+    std::uintptr_t captured[memstats_stack_max_depth];
+#if MEMSTAT_HAVE_UNWIND
+    MemStatsUnwindState state{captured, skip + 1, 0};
+    _Unwind_Backtrace(memstats_unwind_frame, &state);
+    std::size_t depth = state.depth;
+#else
+    auto stacktrace = std::basic_stacktrace<MallocAllocator<std::stacktrace_entry> >::current(
+        skip + 1, memstats_stack_max_depth);
+    std::size_t depth = stacktrace.size();
+    for (std::size_t i = 0; i != depth; ++i)
+        captured[i] = reinterpret_cast<std::uintptr_t>(stacktrace[i].native_handle());
+#endif
+    const std::size_t library = memstats_library_frames(captured, depth, caller);
+    const std::uintptr_t *frames = captured + library;
+    depth -= library;
+
+    const std::uint64_t hash = memstats_hash_frames(frames, depth);
+    if (const std::uint32_t id = memstats_probe_stack(*table, hash, frames, depth, nullptr, inserted))
+        return id;
+    MemStatsStack *created = memstats_create_stack(*table, hash, frames, depth);
+    if (!created)
+        return 0;
+#if MEMSTAT_HAVE_STACKTRACE
+#if MEMSTAT_HAVE_UNWIND
+    created->representative = created->representative.current(skip + 1 + library, memstats_stack_max_depth);
+#else
+    if (library)
+        created->representative = created->representative.current(skip + 1 + library, memstats_stack_max_depth);
+    else
+        created->representative = std::move(stacktrace);
+#endif
+#endif
+    return memstats_probe_stack(*table, hash, frames, depth, created, inserted);
+}
+#endif
 
+// stack of id 'id', or nullptr if unknown
+const MemStatsStack *memstats_stack(std::uint32_t id) {
+    MemStatsStackTable *table = memstats_stack_table.load(std::memory_order_acquire);
+    if (!id or !table or id >= table->capacity)
+        return nullptr;
+    return table->by_id()[id].load(std::memory_order_acquire);
+}
 
+// name of the 'i'-th frame of 'stack', resolved once per return address. Requires 'memstats_lock'.
+const string &memstats_symbolize(const MemStatsStack &stack, std::size_t i) {
+    // never destroyed: reports may run at exit
+    static unordered_map<std::uintptr_t, string> *names =
+            ::new(memstats_raw_malloc(sizeof(unordered_map<std::uintptr_t, string>))) unordered_map<std::uintptr_t,
+                string>{};
+    const std::uintptr_t address = stack.frames()[i];
+    auto it = names->find(address);
+    if (it != names->end())
+        return it->second;
+
+    stringstream stream;
 #if MEMSTAT_HAVE_STACKTRACE
-        register_stats(stacktrace_stats[info.stacktrace]);
-        for (auto entry : info.stacktrace)
-            register_stats(stacktrace_entry_stats[entry]);
+    if (i < stack.representative.size()) {
+        stream << stack.representative[i];
+        return names->emplace(address, stream.str()).first->second;
+    }
 #endif
+#if MEMSTAT_HAVE_DLADDR
+    // the return address points after the call, the call itself is the byte before
+    Dl_info info;
+    if (address and dladdr(reinterpret_cast<void *>(address - 1), &info) and info.dli_fname) {
+        if (info.dli_sname) {
+            int status = -1;
+            char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            stream << (status == 0 ? demangled : info.dli_sname) << "+0x" << std::hex
+                    << address - reinterpret_cast<std::uintptr_t>(info.dli_saddr);
+            std::free(demangled);
+        } else {
+            stream << reinterpret_cast<void *>(address);
+        }
+        stream << " in " << info.dli_fname;
+        return names->emplace(address, stream.str()).first->second;
     }
+#endif
+    stream << reinterpret_cast<void *>(address);
+    return names->emplace(address, stream.str()).first->second;
+}
 
-    static const std::array<char, 11> metric_prefix{' ', 'k', 'M', 'G', 'T', 'P', 'E', 'Z', 'Y', 'R', 'Q'};
-    auto bytes_to_string = [&](std::size_t bytes) {
-        stringstream stream;
-        short base = std::floor(std::log2(bytes) / 10);
-        if (base > metric_prefix.size())
-            throw std::out_of_range{"Too many bytes to use SI prefixes"};
-        stream << short(bytes / (std::pow(1024, base))) << metric_prefix[base] << 'B';
-        return stream.str();
-    };
+// prints the frames of the stack of id 'id', as 'std::stacktrace' does. Requires 'memstats_lock'.
+void memstats_print_stack(std::ostream &out, std::uint32_t id) {
+    if (const MemStatsStack *stack = memstats_stack(id))
+        for (std::size_t i = 0; i != stack->depth; ++i)
+            out << std::right << std::setw(4) << i << "# " << memstats_symbolize(*stack, i) << '\n';
+}
 
-    auto int_to_string = [&](std::size_t val) {
-        stringstream stream;
-        short base = std::floor(std::log10(val) / 3);
-        if (base > metric_prefix.size())
-            throw std::out_of_range{"Integer is too big to use SI prefixes"};
-        stream << short(val / (std::pow(1000, base))) << metric_prefix[base];
-        return stream.str();
-    };
-    const auto str_precentage = memstats_str_hist_representation();
-    const auto bins = memstats_bins();
-    auto format_histogram = [&](const Stats &stats) {
-        std::vector<std::size_t, MallocAllocator<std::size_t> > hist(bins, 0);
-        std::size_t max_size = 0;
-        for (const auto &frec: stats.size_freq) {
-            std::size_t size = frec.first, count = frec.second;
-            assert(size <= stats.max_size);
-            auto bin = (bins * (size - 1)) / (stats.max_size);
-            max_size = std::max(hist[bin] += count, max_size);
-        }
-        stringstream stream;
-        stream << "[";
-        for (auto size: hist) {
-            const std::size_t bin_entry =
-                    (size * str_precentage.second) / max_size;
-            // maximum value (size==max_size) will be out of range so we need to guard agains that
-            stream << str_precentage.first[std::min(bin_entry, str_precentage.second - 1)];
-        }
-        stream << "]" << std::left << std::setw(6) << bytes_to_string(stats.max_size);
-        return stream.str();
+/** Regions name phases of the program, e.g. "request parse", and nest on a stack per thread. A region is
+ * interned with the region around it, so that the same name reached by different paths is reported separately,
+ * and events only store the 16-bit id of the innermost region. As stacks, regions are interned into a table
+ * that is only inserted into, with a compare-and-swap, so entering a region never takes a lock.
+ */
+constexpr std::size_t memstats_region_capacity = std::size_t(1) << 12;
+constexpr std::size_t memstats_region_max_depth = 64;
+
+struct MemStatsRegionNode {
+    std::uint64_t hash;
+    std::uint32_t id;
+    std::uint32_t parent; // id of the region around this one, 0 if none
+    std::uint32_t length;
+
+    // 'length' characters of the name and a null terminator, stored past the end of the struct
+    char *name() {
+        return reinterpret_cast<char *>(this + 1);
+    }
+
+    const char *name() const {
+        return reinterpret_cast<const char *>(this + 1);
+    }
+};
+
+// zero-initialized, so regions may be entered at any time of the program
+static std::atomic<MemStatsRegionNode *> memstats_region_slots[memstats_region_capacity];
+static std::atomic<MemStatsRegionNode *> memstats_region_by_id[memstats_region_capacity];
+MEMSTATS_CONSTINIT static std::atomic<std::uint32_t> memstats_region_count{0};
+
+// regions entered by the thread, deeper ones than 'memstats_region_max_depth' are accounted to the deepest one
+MEMSTATS_CONSTINIT static thread_local std::uint16_t memstats_region_stack[memstats_region_max_depth] = {};
+MEMSTATS_CONSTINIT static thread_local std::size_t memstats_region_depth = 0;
+
+// id of the region 'name' inside 'parent', or 'parent' if the table is full. 'inserted' is set for a new region.
+std::uint32_t memstats_intern_region(std::uint32_t parent, const char *name, bool &inserted) {
+    const std::size_t length = std::strlen(name);
+    std::uint64_t hash = 0xcbf29ce484222325ull ^ parent;
+    for (std::size_t i = 0; i != length; ++i)
+        hash = (hash ^ static_cast<unsigned char>(name[i])) * 0x100000001b3ull;
+
+    MemStatsRegionNode *created = nullptr;
+    const std::size_t mask = memstats_region_capacity - 1;
+    for (std::size_t i = hash & mask, probes = 0; probes != memstats_region_capacity; i = (i + 1) & mask, ++probes) {
+        MemStatsRegionNode *region = memstats_region_slots[i].load(std::memory_order_acquire);
+        if (!region) {
+            if (!created) {
+                const std::uint32_t id = memstats_region_count.fetch_add(1, std::memory_order_relaxed) + 1;
+                void *ptr = id < memstats_region_capacity
+                                ? memstats_raw_malloc(sizeof(MemStatsRegionNode) + length + 1)
+                                : nullptr;
+                if (!ptr)
+                    return parent;
+                created = ::new(ptr) MemStatsRegionNode{hash, id, parent, static_cast<std::uint32_t>(length)};
+                std::memcpy(created->name(), name, length + 1);
+            }
+            if (memstats_region_slots[i].compare_exchange_strong(region, created, std::memory_order_acq_rel)) {
+                memstats_region_by_id[created->id].store(created, std::memory_order_release);
+                inserted = true;
+                return created->id;
+            }
+            // another thread inserted a region in this slot first, it may be the same one
+        }
+        if (region->hash == hash and region->parent == parent and region->length == length and
+            std::memcmp(region->name(), name, length) == 0) {
+            if (created)
+                memstats_raw_free(created);
+            return region->id;
+        }
+    }
+    if (created)
+        memstats_raw_free(created);
+    return parent;
+}
+
+// region of id 'id', or nullptr if unknown
+const MemStatsRegionNode *memstats_region(std::uint32_t id) {
+    if (!id or id >= memstats_region_capacity)
+        return nullptr;
+    return memstats_region_by_id[id].load(std::memory_order_acquire);
+}
+
+// innermost region entered by the calling thread, 0 if none
+inline std::uint32_t memstats_current_region() {
+    const std::size_t depth = std::min(memstats_region_depth, memstats_region_max_depth);
+    return depth ? memstats_region_stack[depth - 1] : 0;
+}
+
+// names of the regions from the outermost one to the region of id 'id', e.g. "request > parse"
+string memstats_region_path(std::uint32_t id) {
+    string path;
+    for (const MemStatsRegionNode *region = memstats_region(id); region; region = memstats_region(region->parent))
+        path = path.empty() ? string{region->name()} : string{region->name()} + " > " + path;
+    return path;
+}
+
+/** Events are written by each thread into its own buffer so that recording never takes a lock.
+ * A buffer is a singly linked list of fixed-size chunks with exactly one producer (the owning thread)
+ * and at most one consumer (the thread reporting, which holds 'memstats_lock'). The producer publishes
+ * each event by a release-store on the chunk size, so the consumer may drain a buffer while its thread
+ * keeps recording. Chunks never move, so recording never copies previously recorded events.
+ */
+constexpr std::size_t memstats_cache_line = 64;
+constexpr std::size_t memstats_chunk_capacity = (std::size_t(1) << 16) / sizeof(MemStatsInfo);
+
+struct alignas(memstats_cache_line) MemStatsChunk {
+    std::atomic<std::size_t> size;
+    std::atomic<MemStatsChunk *> next;
+    alignas(memstats_cache_line) unsigned char storage[memstats_chunk_capacity * sizeof(MemStatsInfo)];
+
+    MemStatsInfo *events() {
+        return reinterpret_cast<MemStatsInfo *>(storage);
+    }
+
+    // empties a chunk that is handed out again, so that no stale link of its previous list survives
+    void reset() {
+        size.store(0, std::memory_order_relaxed);
+        next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    static MemStatsChunk *create();
+    static void destroy(MemStatsChunk *chunk);
+};
+
+/** Chunks preallocated for 'MEMSTATS_EVENT_CAPACITY' events, in one segment mapped at start-up with its pages
+ * touched up front, so that recording neither calls the allocator nor faults on a new page until the capacity
+ * is used up. Free chunks form a lock-free stack of chunk indices: producers pop from it and the consumer pushes
+ * drained chunks back. The top is tagged with a counter, so that a chunk popped and pushed back in between does
+ * not fool a compare-and-swap. Never destroyed.
+ */
+struct MemStatsChunkPool {
+    MemStatsChunk *chunks;
+    std::atomic<std::uint32_t> *links; // per chunk, 1 + index of the next free chunk or 0
+    std::size_t count;
+    std::atomic<std::uint64_t> top;    // tag in the upper 32 bits, 1 + index of the first free chunk or 0 in the lower
+
+    bool owns(const MemStatsChunk *chunk) const {
+        return chunk >= chunks and chunk < chunks + count;
+    }
+
+    MemStatsChunk *pop() {
+        std::uint64_t old_top = top.load(std::memory_order_acquire);
+        while (const std::uint32_t index = static_cast<std::uint32_t>(old_top)) {
+            const std::uint64_t new_top = ((old_top >> 32) + 1) << 32 | links[index - 1].load(std::memory_order_relaxed);
+            if (top.compare_exchange_weak(old_top, new_top, std::memory_order_acquire, std::memory_order_acquire)) {
+                MemStatsChunk *chunk = chunks + (index - 1);
+                chunk->reset();
+                return chunk;
+            }
+        }
+        return nullptr;
+    }
+
+    void push(MemStatsChunk *chunk) {
+        const std::uint32_t index = static_cast<std::uint32_t>(chunk - chunks);
+        std::uint64_t old_top = top.load(std::memory_order_relaxed);
+        do {
+            links[index].store(static_cast<std::uint32_t>(old_top), std::memory_order_relaxed);
+        } while (!top.compare_exchange_weak(old_top, ((old_top >> 32) + 1) << 32 | (index + 1),
+                                            std::memory_order_release, std::memory_order_relaxed));
+    }
+};
+
+MemStatsChunkPool *init_memstats_chunk_pool() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    const char *ptr = std::getenv("MEMSTATS_EVENT_CAPACITY");
+    if (!ptr)
+        return nullptr;
+    char *end = nullptr;
+    const unsigned long long capacity = std::strtoull(ptr, &end, 10);
+    if (end == ptr or *end) {
+        std::cerr << "Option 'MEMSTATS_EVENT_CAPACITY=" << ptr << "' not known. Fallback on default '0'\n";
+        return nullptr;
+    }
+    // with a trace file, events are streamed to it instead of the chunks
+    if (!capacity or memstats_mode != MemStatsMode::events or std::getenv("MEMSTATS_TRACE_FILE"))
+        return nullptr;
+    const std::size_t count = std::min<unsigned long long>((capacity + memstats_chunk_capacity - 1) /
+                                                           memstats_chunk_capacity, std::uint32_t(-1));
+    const std::size_t bytes = count * sizeof(MemStatsChunk);
+#if MEMSTAT_HAVE_MMAP
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_POPULATE)
+    flags |= MAP_POPULATE;
+#endif
+    void *segment = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (segment == MAP_FAILED)
+        segment = nullptr;
+#else
+    void *segment = memstats_aligned_malloc(alignof(MemStatsChunk), bytes);
+#endif
+    void *links = memstats_raw_malloc(count * sizeof(std::atomic<std::uint32_t>));
+    void *pool = memstats_raw_malloc(sizeof(MemStatsChunkPool));
+    if (!segment or !links or !pool) {
+        std::cerr << "Option 'MEMSTATS_EVENT_CAPACITY=" << ptr << "' could not be allocated. Fallback on default '0'\n";
+        return nullptr;
+    }
+#if !(MEMSTAT_HAVE_MMAP && defined(MAP_POPULATE))
+    // touches every page up front
+    std::memset(segment, 0, bytes);
+#endif
+    // every chunk is free, in order
+    std::atomic<std::uint32_t> *link = static_cast<std::atomic<std::uint32_t> *>(links);
+    for (std::size_t i = 0; i != count; ++i)
+        ::new(link + i) std::atomic<std::uint32_t>(i + 1 == count ? 0 : static_cast<std::uint32_t>(i + 2));
+    return ::new(pool) MemStatsChunkPool{static_cast<MemStatsChunk *>(segment), link, count, {1}};
+}
+
+static MemStatsChunkPool *memstats_chunk_pool = init_memstats_chunk_pool();
+
+MemStatsChunk *MemStatsChunk::create() {
+    if (MemStatsChunk *chunk = memstats_chunk_pool ? memstats_chunk_pool->pop() : nullptr)
+        return chunk;
+    void *ptr = memstats_aligned_malloc(alignof(MemStatsChunk), sizeof(MemStatsChunk));
+    if (!ptr)
+        throw std::bad_alloc{};
+    MemStatsChunk *chunk = static_cast<MemStatsChunk *>(ptr);
+    chunk->reset();
+    return chunk;
+}
+
+void MemStatsChunk::destroy(MemStatsChunk *chunk) {
+    if (memstats_chunk_pool and memstats_chunk_pool->owns(chunk))
+        memstats_chunk_pool->push(chunk);
+    else
+        memstats_aligned_free(chunk);
+}
+
+// number of bins of the log2 size histogram, bin 'b' counts sizes in [2^b, 2^(b+1))
+constexpr std::size_t memstats_size_bins = std::numeric_limits<std::size_t>::digits;
+
+std::size_t memstats_log2(std::size_t value) {
+#if defined(__GNUC__)
+    return std::numeric_limits<unsigned long long>::digits - 1 - __builtin_clzll(value);
+#else
+    std::size_t bin = 0;
+    while (value >>= 1)
+        ++bin;
+    return bin;
+#endif
+}
+
+/** Running counters of a thread in aggregate mode. Counts, sizes and frees only grow and are written only by the
+ * owning thread, so relaxed load/store pairs are enough to update them; the consumer never resets them but
+ * remembers what it read last ('MemStatsCounterValues'), and reports the difference. The maximum size since the
+ * last collection is reset by the consumer, so both sides update it with read-modify-write operations.
+ * Counts and sizes are estimates weighted by the sampling probability, and exact without sampling.
+ */
+struct alignas(memstats_cache_line) MemStatsCounters {
+    std::atomic<double> count{0}, size{0};
+    std::atomic<std::size_t> max_size{0}, frees{0};
+    std::atomic<double> size_bins[memstats_size_bins] = {};
+
+    template<class T>
+    static void add(std::atomic<T> &counter, T value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void record(std::size_t sz, double weight) {
+        if (sz == 0) {
+            add(frees, std::size_t(1));
+            return;
+        }
+        add(count, weight);
+        add(size, weight * double(sz));
+        std::size_t max = max_size.load(std::memory_order_relaxed);
+        while (sz > max and !max_size.compare_exchange_weak(max, sz, std::memory_order_relaxed)) {
+        }
+        add(size_bins[memstats_log2(sz)], weight);
+    }
+};
+
+// values of 'MemStatsCounters' read by the consumer at the last collection
+struct MemStatsCounterValues {
+    double count = 0, size = 0;
+    std::size_t frees = 0;
+    double size_bins[memstats_size_bins] = {};
+};
+
+#if MEMSTAT_HAVE_TRACE
+/** Writer of the binary trace of 'MEMSTATS_TRACE_FILE' (format in 'memstats_trace.hh').
+ * The file is mapped once with a large reservation and grown on demand, so chunks never move.
+ * Each thread appends its events to its own chunk without taking a lock; a new chunk is
+ * claimed by an atomic increment of the chunk index and, rarely, by growing the file.
+ * Since the mapping is shared with the file, records survive a crash of the process.
+ */
+class MemStatsTraceWriter {
+public:
+    static MemStatsTraceWriter *open(const char *path);
+
+    // appends an event to 'chunk', which is replaced by a fresh chunk of 'thread' when full
+    void write(MemStatsTraceChunk *&chunk, std::uint32_t thread, const MemStatsInfo &info);
+
+    // appends a stack of the stack table, once when it is first seen
+    void write_stack(const MemStatsStack &stack);
+
+    // appends a region, once when it is first entered
+    void write_region(const MemStatsRegionNode &region);
+
+    // marks the trace as complete and truncates it to its chunks, later events that need a new chunk are dropped
+    void finish();
+
+private:
+    static constexpr std::uint64_t grow_step = std::uint64_t(64) << 20;
+
+    MemStatsTraceChunk *allocate_chunk(std::uint32_t type, std::uint32_t thread, std::uint64_t base_time,
+                                       std::uint64_t thread_id);
+
+    int fd = -1;
+    unsigned char *base = nullptr;
+    std::uint64_t reservation = 0;
+    std::uint64_t start = 0; // ticks of 'memstats_clock'
+    std::atomic<std::uint64_t> chunks{0};
+    std::atomic<std::uint64_t> file_size{0};
+    std::mutex grow_mutex;
+    std::mutex stack_mutex; // guards the chunks of stacks and regions
+    MemStatsTraceChunk *stack_chunk = nullptr;
+    MemStatsTraceChunk *region_chunk = nullptr;
+};
+
+MemStatsTraceWriter *MemStatsTraceWriter::open(const char *path) {
+    const int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return nullptr;
+    // address space is cheap: reserve once so that chunks handed out never move
+    const std::uint64_t reservation = sizeof(void *) == 8 ? std::uint64_t(1) << 40 : std::uint64_t(1) << 30;
+    void *base = ::mmap(nullptr, reservation, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (base == MAP_FAILED or ::ftruncate(fd, grow_step) != 0) {
+        if (base != MAP_FAILED)
+            ::munmap(base, reservation);
+        ::close(fd);
+        return nullptr;
+    }
+    void *ptr = memstats_raw_malloc(sizeof(MemStatsTraceWriter));
+    if (!ptr) {
+        ::munmap(base, reservation);
+        ::close(fd);
+        return nullptr;
+    }
+    MemStatsTraceWriter *writer = ::new(ptr) MemStatsTraceWriter{};
+    writer->fd = fd;
+    writer->base = static_cast<unsigned char *>(base);
+    writer->reservation = reservation;
+    writer->start = memstats_now();
+    writer->file_size.store(grow_step, std::memory_order_relaxed);
+
+    MemStatsTraceHeader *header = static_cast<MemStatsTraceHeader *>(base);
+    header->magic = memstats_trace_magic;
+    header->version = memstats_trace_version;
+    header->chunk_size = memstats_trace_chunk_size;
+    header->header_size = sizeof(MemStatsTraceHeader);
+    header->sample_rate = memstats_sample_rate;
+    header->clean_exit.store(0, std::memory_order_relaxed);
+    return writer;
+}
+
+MemStatsTraceChunk *MemStatsTraceWriter::allocate_chunk(std::uint32_t type, std::uint32_t thread,
+                                                        std::uint64_t base_time, std::uint64_t thread_id) {
+    const std::uint64_t index = chunks.fetch_add(1, std::memory_order_relaxed);
+    const std::uint64_t offset = sizeof(MemStatsTraceHeader) + index * memstats_trace_chunk_size;
+    const std::uint64_t end = offset + memstats_trace_chunk_size;
+    if (end > reservation)
+        return nullptr;
+    if (end > file_size.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lk{grow_mutex};
+        if (end > file_size.load(std::memory_order_relaxed)) {
+            const std::uint64_t size = std::min((end + grow_step - 1) / grow_step * grow_step, reservation);
+            if (::ftruncate(fd, static_cast<off_t>(size)) != 0)
+                return nullptr;
+            file_size.store(size, std::memory_order_release);
+        }
+    }
+    MemStatsTraceChunk *chunk = reinterpret_cast<MemStatsTraceChunk *>(base + offset);
+    chunk->thread = thread;
+    chunk->base_time = base_time;
+    chunk->thread_id = thread_id;
+    chunk->used.store(0, std::memory_order_relaxed);
+    chunk->type = type;
+    return chunk;
+}
+
+void MemStatsTraceWriter::write(MemStatsTraceChunk *&chunk, std::uint32_t thread, const MemStatsInfo &info) {
+    const std::uint64_t time = info.time > start ? std::uint64_t(memstats_ticks_to_ns(info.time - start)) : 0;
+    std::uint32_t used = chunk ? chunk->used.load(std::memory_order_relaxed) : 0;
+    if (!chunk or used == memstats_trace_chunk_events or time < chunk->base_time) {
+        // the id is stored as in memory, which is how the report prints it on common implementations
+        std::uint64_t thread_id = 0;
+        std::memcpy(&thread_id, &info.thread, std::min(sizeof(thread_id), sizeof(info.thread)));
+        chunk = allocate_chunk(memstats_trace_events, thread, time, thread_id);
+        if (!chunk)
+            return; // the trace is full, drop the event
+        used = 0;
+    }
+    MemStatsTraceEvent &event = reinterpret_cast<MemStatsTraceEvent *>(chunk + 1)[used];
+    event.ptr = reinterpret_cast<std::uintptr_t>(info.ptr);
+    event.size = info.size;
+    event.time = time - chunk->base_time;
+    event.stack = info.stack;
+    event.form = info.form;
+    event.alignment = info.alignment ? static_cast<std::uint8_t>(memstats_log2(info.alignment)) : 0;
+    event.region = info.region;
+    chunk->used.store(used + 1, std::memory_order_release);
+}
+
+void MemStatsTraceWriter::write_stack(const MemStatsStack &stack) {
+    constexpr std::size_t capacity = memstats_trace_chunk_size - sizeof(MemStatsTraceChunk);
+    const std::size_t bytes = sizeof(MemStatsTraceStack) + stack.depth * sizeof(std::uint64_t);
+    std::lock_guard<std::mutex> lk{stack_mutex};
+    std::uint32_t used = stack_chunk ? stack_chunk->used.load(std::memory_order_relaxed) : 0;
+    if (!stack_chunk or used + bytes > capacity) {
+        stack_chunk = allocate_chunk(memstats_trace_stacks, 0, 0, 0);
+        if (!stack_chunk)
+            return;
+        used = 0;
+    }
+    unsigned char *out = reinterpret_cast<unsigned char *>(stack_chunk + 1) + used;
+    const MemStatsTraceStack record{stack.id, stack.depth};
+    std::memcpy(out, &record, sizeof(record));
+    for (std::size_t i = 0; i != stack.depth; ++i) {
+        const std::uint64_t address = stack.frames()[i];
+        std::memcpy(out + sizeof(record) + i * sizeof(address), &address, sizeof(address));
+    }
+    stack_chunk->used.store(static_cast<std::uint32_t>(used + bytes), std::memory_order_release);
+}
+
+void MemStatsTraceWriter::write_region(const MemStatsRegionNode &region) {
+    constexpr std::size_t capacity = memstats_trace_chunk_size - sizeof(MemStatsTraceChunk);
+    const std::size_t length = std::min<std::size_t>(region.length, capacity - sizeof(MemStatsTraceRegion));
+    const std::size_t bytes = sizeof(MemStatsTraceRegion) + (length + 7) / 8 * 8;
+    std::lock_guard<std::mutex> lk{stack_mutex};
+    std::uint32_t used = region_chunk ? region_chunk->used.load(std::memory_order_relaxed) : 0;
+    if (!region_chunk or used + bytes > capacity) {
+        region_chunk = allocate_chunk(memstats_trace_regions, 0, 0, 0);
+        if (!region_chunk)
+            return;
+        used = 0;
+    }
+    unsigned char *out = reinterpret_cast<unsigned char *>(region_chunk + 1) + used;
+    const MemStatsTraceRegion record{region.id, region.parent, static_cast<std::uint32_t>(length), 0};
+    std::memcpy(out, &record, sizeof(record));
+    std::memcpy(out + sizeof(record), region.name(), length);
+    region_chunk->used.store(static_cast<std::uint32_t>(used + bytes), std::memory_order_release);
+}
+
+void MemStatsTraceWriter::finish() {
+    // resolve each distinct frame once, so that the trace can be analyzed without the binary
+    std::unique_lock<std::recursive_mutex> lock{memstats_lock};
+    constexpr std::size_t capacity = memstats_trace_chunk_size - sizeof(MemStatsTraceChunk);
+    unordered_map<std::uintptr_t, bool> resolved;
+    MemStatsTraceChunk *chunk = nullptr;
+    std::size_t used = 0;
+    const MemStatsStackTable *table = memstats_stack_table.load(std::memory_order_acquire);
+    const std::uint32_t stacks = table ? table->count.load(std::memory_order_acquire) : 0;
+    for (std::uint32_t id = 1; id <= stacks and id < table->capacity; ++id) {
+        const MemStatsStack *stack = memstats_stack(id);
+        for (std::size_t i = 0; stack and i != stack->depth; ++i) {
+            if (!resolved.emplace(stack->frames()[i], true).second)
+                continue;
+            const string &name = memstats_symbolize(*stack, i);
+            const std::size_t length = std::min(name.size(), capacity - sizeof(MemStatsTraceSymbol));
+            const std::size_t bytes = sizeof(MemStatsTraceSymbol) + (length + 7) / 8 * 8;
+            if (!chunk or used + bytes > capacity) {
+                if (!(chunk = allocate_chunk(memstats_trace_symbols, 0, 0, 0)))
+                    break;
+                used = 0;
+            }
+            unsigned char *out = reinterpret_cast<unsigned char *>(chunk + 1) + used;
+            const MemStatsTraceSymbol record{stack->frames()[i], static_cast<std::uint32_t>(length), 0};
+            std::memcpy(out, &record, sizeof(record));
+            std::memcpy(out + sizeof(record), name.data(), length);
+            used += bytes;
+            chunk->used.store(static_cast<std::uint32_t>(used), std::memory_order_release);
+        }
+    }
+    // no chunk is handed out anymore, so the file can end with the last one instead of the zeros of the last step
+    const std::uint64_t max_chunks = (reservation - sizeof(MemStatsTraceHeader)) / memstats_trace_chunk_size;
+    const std::uint64_t used_chunks = std::min(chunks.exchange(max_chunks, std::memory_order_acq_rel), max_chunks);
+    const std::uint64_t size = sizeof(MemStatsTraceHeader) + used_chunks * memstats_trace_chunk_size;
+    {
+        std::lock_guard<std::mutex> lk{grow_mutex};
+        if (::ftruncate(fd, static_cast<off_t>(size)) == 0)
+            file_size.store(size, std::memory_order_release);
+    }
+    reinterpret_cast<MemStatsTraceHeader *>(base)->clean_exit.store(1, std::memory_order_release);
+    ::msync(base, file_size.load(std::memory_order_acquire), MS_ASYNC);
+}
+#endif
+
+// Writer of 'MEMSTATS_TRACE_FILE', or nullptr to keep events in memory until they are reported
+#if MEMSTAT_HAVE_TRACE
+using MemStatsTrace = MemStatsTraceWriter;
+#else
+using MemStatsTrace = void;
+#endif
+
+MemStatsTrace *init_memstats_trace() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    const char *path = std::getenv("MEMSTATS_TRACE_FILE");
+    if (!path or !*path)
+        return nullptr;
+#if MEMSTAT_HAVE_TRACE
+    if (MemStatsTraceWriter *writer = MemStatsTraceWriter::open(path))
+        return writer;
+    std::cerr << "Option 'MEMSTATS_TRACE_FILE=" << path << "' could not be opened: " << std::strerror(errno)
+            << ". Fallback on events in memory\n";
+#else
+    std::cerr << "Option 'MEMSTATS_TRACE_FILE' is not supported on this platform. Fallback on events in memory\n";
+#endif
+    return nullptr;
+}
+
+static MemStatsTrace *memstats_trace = init_memstats_trace();
+
+// who works on the consumer side of a thread buffer
+constexpr std::uint8_t memstats_buffer_idle = 0, memstats_buffer_draining = 1, memstats_buffer_recycling = 2;
+
+struct alignas(memstats_cache_line) MemStatsThreadBuffer {
+    // producer side
+    MemStatsChunk *tail = nullptr;
+    std::thread::id thread = {};
+    std::uint32_t index = 0; // order of creation, identifies the thread in the trace file
+#if MEMSTAT_HAVE_TRACE
+    MemStatsTraceChunk *trace_chunk = nullptr;
+#endif
+    MemStatsCounters counters;
+    // set by the producer when its thread exits, the consumer releases the buffer once drained
+    std::atomic<bool> retired{false};
+    // consumer side, also taken over by the producer to recycle its oldest chunk in ring mode
+    alignas(memstats_cache_line) std::atomic<std::uint8_t> owner{memstats_buffer_idle};
+    MemStatsChunk *head = nullptr;
+    std::size_t head_read = 0;
+    MemStatsCounterValues counters_read;
+    MemStatsThreadBuffer *next = nullptr;
+
+    static MemStatsThreadBuffer *create();
+    static void destroy(MemStatsThreadBuffer *buffer);
+
+    void push(MemStatsInfo &&info);
+
+    MemStatsChunk *recycle();
+
+    template<class F>
+    void drain(F &&consume);
+};
+
+// Registry of all thread buffers. Producers only push at the front, the consumer is the only one to unlink.
+MEMSTATS_CONSTINIT static std::atomic<MemStatsThreadBuffer *> memstats_thread_buffers{nullptr};
+MEMSTATS_CONSTINIT static std::atomic<std::uint32_t> memstats_thread_buffers_created{0};
+
+MemStatsThreadBuffer *MemStatsThreadBuffer::create() {
+    void *ptr = memstats_aligned_malloc(alignof(MemStatsThreadBuffer), sizeof(MemStatsThreadBuffer));
+    if (!ptr)
+        throw std::bad_alloc{};
+    MemStatsThreadBuffer *buffer = ::new(ptr) MemStatsThreadBuffer{};
+    // with a trace file, events are streamed to it instead of the chunks
+    if (memstats_mode == MemStatsMode::events and !memstats_trace)
+        buffer->tail = buffer->head = MemStatsChunk::create();
+    buffer->thread = std::this_thread::get_id();
+    buffer->index = memstats_thread_buffers_created.fetch_add(1, std::memory_order_relaxed);
+    buffer->next = memstats_thread_buffers.load(std::memory_order_relaxed);
+    while (!memstats_thread_buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release,
+                                                          std::memory_order_relaxed)) {
+    }
+    return buffer;
+}
+
+void MemStatsThreadBuffer::destroy(MemStatsThreadBuffer *buffer) {
+    for (MemStatsChunk *chunk = buffer->head; chunk;) {
+        MemStatsChunk *next = chunk->next.load(std::memory_order_relaxed);
+        MemStatsChunk::destroy(chunk);
+        chunk = next;
+    }
+    buffer->~MemStatsThreadBuffer();
+    memstats_aligned_free(buffer);
+}
+
+bool init_memstats_event_ring() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    if (char *ptr = std::getenv("MEMSTATS_EVENT_RING")) {
+        if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0) {
+            if (memstats_chunk_pool)
+                return true;
+            std::cerr << "Option 'MEMSTATS_EVENT_RING' needs 'MEMSTATS_EVENT_CAPACITY' with events in memory. "
+                    "Fallback on default 'false'\n";
+            return false;
+        }
+        if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
+            return false;
+        std::cerr << "Option 'MEMSTATS_EVENT_RING=" << ptr << "' not known. Fallback on default 'false'\n";
+    }
+    return false;
+}
+
+// Whether to keep only the last 'MEMSTATS_EVENT_CAPACITY' events, instead of allocating more chunks once it is used up
+static bool memstats_event_ring = init_memstats_event_ring();
+// events dropped by the ring since the last collection
+MEMSTATS_CONSTINIT static std::atomic<std::size_t> memstats_dropped_events{0};
+
+/** Takes the full chunk holding the oldest events of this thread not drained yet and drops its events, or returns
+ * nullptr if the buffer is down to the chunk its thread writes into or the consumer is draining it meanwhile.
+ * Only used by the producer once the pool is used up; it never waits for the consumer.
+ */
+MemStatsChunk *MemStatsThreadBuffer::recycle() {
+    std::uint8_t idle = memstats_buffer_idle;
+    if (!owner.compare_exchange_strong(idle, memstats_buffer_recycling, std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+        return nullptr;
+    MemStatsChunk *chunk = head != tail ? head : nullptr;
+    if (chunk) {
+        for (std::size_t i = head_read; i != memstats_chunk_capacity; ++i)
+            chunk->events()[i].~MemStatsInfo();
+        memstats_dropped_events.fetch_add(memstats_chunk_capacity - head_read, std::memory_order_relaxed);
+        head = chunk->next.load(std::memory_order_relaxed);
+        head_read = 0;
+    }
+    owner.store(memstats_buffer_idle, std::memory_order_release);
+    if (chunk)
+        chunk->reset();
+    return chunk;
+}
+
+void MemStatsThreadBuffer::push(MemStatsInfo &&info) {
+    std::size_t size = tail->size.load(std::memory_order_relaxed);
+    if (size == memstats_chunk_capacity) {
+        MemStatsChunk *chunk = nullptr;
+        if (memstats_event_ring) {
+            if (!(chunk = memstats_chunk_pool->pop()) and !(chunk = recycle())) {
+                // the ring is used up and the oldest events of this thread are being drained: drop this one
+                memstats_dropped_events.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        } else {
+            chunk = MemStatsChunk::create();
+        }
+        tail->next.store(chunk, std::memory_order_release);
+        tail = chunk;
+        size = 0;
+    }
+    ::new(tail->events() + size) MemStatsInfo(std::move(info));
+    tail->size.store(size + 1, std::memory_order_release);
+}
+
+/** Hands the events published before the call and not drained before to 'consume', and releases drained chunks.
+ * Events published meanwhile are left for the next drain, so that a producer faster than the consumer cannot
+ * keep it draining forever.
+ */
+template<class F>
+void MemStatsThreadBuffer::drain(F &&consume) {
+    if (!head)
+        return;
+    // a producer recycling its oldest chunk only holds the buffer for a moment
+    for (std::uint8_t idle = memstats_buffer_idle;
+         !owner.compare_exchange_weak(idle, memstats_buffer_draining, std::memory_order_acquire,
+                                      std::memory_order_relaxed);
+         idle = memstats_buffer_idle)
+        std::this_thread::yield();
+    MemStatsChunk *last = head;
+    while (MemStatsChunk *next = last->next.load(std::memory_order_acquire))
+        last = next;
+    const std::size_t last_size = last->size.load(std::memory_order_acquire);
+    while (true) {
+        // chunks followed by another one are full
+        const std::size_t size = head == last ? last_size : memstats_chunk_capacity;
+        for (; head_read != size; ++head_read) {
+            MemStatsInfo &info = head->events()[head_read];
+            consume(std::move(info));
+            info.~MemStatsInfo();
+        }
+        if (head == last)
+            break;
+        MemStatsChunk *next = head->next.load(std::memory_order_acquire);
+        MemStatsChunk::destroy(head);
+        head = next;
+        head_read = 0;
+    }
+    owner.store(memstats_buffer_idle, std::memory_order_release);
+}
+
+// events recorded after the thread buffer was retired (e.g. by other thread-local destructors) land here
+static MemStatsThreadBuffer *memstats_orphan_buffer = nullptr;
+
+struct MemStatsThreadBufferRetire {
+    MemStatsThreadBuffer *buffer;
+
+    ~MemStatsThreadBufferRetire();
+};
+
+// Constant-initialized, so recording is possible at any time of the thread lifetime
+MEMSTATS_CONSTINIT static thread_local MemStatsThreadBuffer *memstats_thread_buffer = nullptr;
+MEMSTATS_CONSTINIT static thread_local bool memstats_thread_buffer_retired = false;
+
+MemStatsThreadBufferRetire::~MemStatsThreadBufferRetire() {
+    memstats_thread_buffer = nullptr;
+    memstats_thread_buffer_retired = true;
+    buffer->retired.store(true, std::memory_order_release);
+}
+
+// calls 'f(buffer, thread)' with the buffer where the calling thread may record its events
+template<class F>
+void memstats_with_thread_buffer(F &&f) {
+    if (MemStatsThreadBuffer *buffer = memstats_thread_buffer) {
+        f(*buffer, buffer->thread);
+    } else if (!memstats_thread_buffer_retired) {
+        memstats_thread_buffer = buffer = MemStatsThreadBuffer::create();
+        // registers the hand-off of the buffer at thread exit
+        static thread_local MemStatsThreadBufferRetire retire{buffer};
+        f(*buffer, buffer->thread);
+    } else {
+        std::unique_lock<std::recursive_mutex> lk{memstats_lock};
+        if (!memstats_orphan_buffer)
+            memstats_orphan_buffer = MemStatsThreadBuffer::create();
+        f(*memstats_orphan_buffer, std::this_thread::get_id());
+    }
+}
+
+// calls 'visit(buffer)' on every registered buffer and releases the ones of exited threads. Requires 'memstats_lock'.
+template<class F>
+void memstats_for_each_buffer(F &&visit) {
+    MemStatsThreadBuffer *prev = nullptr;
+    for (MemStatsThreadBuffer *buffer = memstats_thread_buffers.load(std::memory_order_acquire); buffer;) {
+        const bool retired = buffer->retired.load(std::memory_order_acquire);
+        visit(*buffer);
+        MemStatsThreadBuffer *next = buffer->next;
+        if (retired) {
+            // a retired buffer will not receive more events: unlink and release it
+            MemStatsThreadBuffer *expected = buffer;
+            if (prev) {
+                prev->next = next;
+            } else if (!memstats_thread_buffers.compare_exchange_strong(expected, next)) {
+                // other buffers were pushed in front of this one in the meantime
+                while (expected->next != buffer)
+                    expected = expected->next;
+                expected->next = next;
+            }
+            MemStatsThreadBuffer::destroy(buffer);
+        } else {
+            prev = buffer;
+        }
+        buffer = next;
+    }
+}
+
+using MemStatsEvents = std::vector<MemStatsInfo, MallocAllocator<MemStatsInfo> >;
+
+// Drains all thread buffers into 'events' ordered by time. Requires 'memstats_lock'.
+void memstats_drain_events(MemStatsEvents &events) {
+    std::vector<std::size_t, MallocAllocator<std::size_t> > bounds(1, events.size());
+    auto consume = [&](MemStatsInfo &&info) { events.push_back(std::move(info)); };
+    memstats_for_each_buffer([&](MemStatsThreadBuffer &buffer) {
+        buffer.drain(consume);
+        if (events.size() != bounds.back())
+            bounds.push_back(events.size());
+    });
+
+    // each buffer is ordered in time, so merging consecutive runs pairwise sorts all of them
+    auto by_time = [](const MemStatsInfo &a, const MemStatsInfo &b) { return a.time < b.time; };
+    while (bounds.size() > 2) {
+        MemStatsEvents merged;
+        merged.reserve(events.size());
+        merged.insert(merged.end(), std::make_move_iterator(events.begin()),
+                      std::make_move_iterator(events.begin() + bounds[0]));
+        std::size_t runs = 0;
+        for (std::size_t i = 0; i + 1 < bounds.size(); i += 2) {
+            const std::size_t last = bounds[std::min(i + 2, bounds.size() - 1)];
+            std::merge(std::make_move_iterator(events.begin() + bounds[i]),
+                       std::make_move_iterator(events.begin() + bounds[i + 1]),
+                       std::make_move_iterator(events.begin() + bounds[i + 1]),
+                       std::make_move_iterator(events.begin() + last),
+                       std::back_inserter(merged), by_time);
+            bounds[++runs] = last;
+        }
+        bounds.resize(runs + 1);
+        events.swap(merged);
+    }
+}
+
+// Set while memstats runs on a thread, so that allocations made on behalf of memstats itself are not recorded
+MEMSTATS_CONSTINIT static thread_local bool memstats_reentrant = false;
+
+class MemStatsReentrancyGuard {
+public:
+    MemStatsReentrancyGuard() : previous(memstats_reentrant) {
+        memstats_reentrant = true;
+    }
+
+    ~MemStatsReentrancyGuard() {
+        memstats_reentrant = previous;
+    }
+
+private:
+    bool previous;
+};
+
+// Zero- and dynamic-initialization of a thread-local variable does not necessarily happen on any order related to the global ones
+static thread_local bool memstats_instrumentation_thread = init_memstats_instrumentation_thread();
+
+// guard thread-local variable to instrument further delets at exit
+bool init_memstats_instrumentation_thread_guard() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    std::atexit([] { memstats_instrumentation_thread = false; });
+    return true;
+}
+
+const static thread_local bool memstats_instrumentation_thread_guard = init_memstats_instrumentation_thread_guard();
+
+// We need to make absolutely sure this is constinit so that 'memstats_instrumentation_global' is const-initialized,
+// otherwise threads will try to syncronize with an uninitialized variable
+#if MEMSTAT_ATOMIC_CONSTEXPR
+MEMSTATS_CONSTINIT static std::atomic<bool> memstats_instrumentation_global{false};
+#else
+#error "MemStats needs a conforming C++ standard library where 'std::atomic<bool>' can be const-initialized, i.e. its constructor is 'constexpr'!"
+#endif
+
+bool init_memstats_instrumentation_guard() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    bool instrument = false;
+    // Note this variable is const-initialized to false. Here we change it to true and syncronize other threads during dynamic initialization
+    if (char *ptr = std::getenv("MEMSTATS_ENABLE_INSTRUMENTATION")) {
+        if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
+            instrument = true;
+        else if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
+            instrument = false;
+        else
+            std::cerr << "Option 'MEMSTATS_ENABLE_INSTRUMENTATION=" << ptr
+                    << "' not known. Fallback on default 'false'\n";
+    }
+    memstats_instrumentation_global.store(instrument, std::memory_order_release);
+    return instrument;
+}
+
+// Const-initialization (happens before dynamic-initialization) assigns 'false' to 'memstats_instrumentation_global' which is fine because no instrumentation will be done, and no thread buffer will be created.
+// By defining 'memstats_instrumentation_global' after 'memstats_lock' we guarantee that they are initialized on that order during dynamic-initialization.
+// meaning that we cannot register memory events before 'memstats_lock' is initialized.
+// Note that we do not want this variable to be const-initialized to 'true' before dynamic-initialization, so we make sure this gets
+// dynamic-initialized in the correct order by delaying its initialization by a non-constexpr function.
+static bool memstats_instrumentation_guard = init_memstats_instrumentation_guard();
+
+bool init_memstats_at_exit() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    static std::once_flag report_flag;
+    std::call_once(report_flag,
+                   [] {
+                       std::atexit([] {
+                           memstats_instrumentation_global.store(false, std::memory_order_release);
+                           bool do_report_at_exit = true;
+                           if (char *ptr = std::getenv("MEMSTATS_REPORT_AT_EXIT")) {
+                               if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
+                                   do_report_at_exit = true;
+                               else if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
+                                   do_report_at_exit = false;
+                               else
+                                   std::cerr << "Option 'MEMSTATS_REPORT_AT_EXIT=" << ptr
+                                           << "' not known. Fallback on default 'true'\n";
+                           }
+                           if (do_report_at_exit)
+                               memstats_report("default");
+#if MEMSTAT_HAVE_TRACE
+                           if (memstats_trace)
+                               memstats_trace->finish();
+#endif
+                       });
+                   });
+    return true;
+}
+
+// Destruction order fiasco also hits here. If a variable destroyed during dynamic-initialization-destruction (reverse order),
+// calls on 'delete' may trigger an access to an already destroyed 'memstats_lock'. Thread buffers are allocated with malloc and never destroyed at exit.
+// Therefore, we make sure to make a 'report' before 'memstats_lock' is destroyed.
+static const bool memstats_at_exit_guard = init_memstats_at_exit();
+
+/** Overview of initialization/destruction order:
+ * memstats_instrumentation_global = false;                                                     // const-initialization
+ * memstats_thread_buffers = nullptr;                                                           // const-initialization
+ * memstats_lock = {};                                                                          // dynamic-initialization
+ * memstats_trace = init_memstats_trace();                                                      // dynamic-initialization
+ * init_memstats_instrumentation_guard(); -> memstats_instrumentation_global = true;            // dynamic-initialization
+ * memstats_at_exit_guard = init_memstats_at_exit();                                    // dynamic-initialization
+ * main();
+ * memstats_instrumentation_global = false;
+ * ~MemStatsThreadBufferRetire(); -> retire main thread buffer                                   // thread-local-destruction
+ * std::atexit(default_report); -> drain memstats_thread_buffers                                // dynamic-initialization-destruction
+ * memstats_lock.~mutex();                                                                      // dynamic-initialization-destruction
+ */
+
+void MemStatsInfo::record(void *ptr, std::size_t sz, std::size_t alignment, unsigned char form, const void *caller) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+    const MemStatsReentrancyGuard reentrancy_guard;
+
+    if (memstats_mode == MemStatsMode::aggregate and !memstats_trace) {
+        memstats_with_thread_buffer([=](MemStatsThreadBuffer &buffer, std::thread::id) {
+            buffer.counters.record(sz, memstats_sample_weight(sz));
+        });
+        return;
+    }
+
+    MemStatsInfo info;
+    info.ptr = ptr;
+    info.size = sz;
+    info.time = memstats_now();
+    info.alignment = alignment;
+    info.form = form;
+    info.region = static_cast<std::uint16_t>(memstats_current_region());
+    bool new_stack = false;
+#if MEMSTAT_HAVE_STACKS
+    // starts at the caller, however many functions of the library are inlined in between
+    if (memstats_stacks == MemStatsStacks::full)
+        info.stack = memstats_intern_stack(0, caller, new_stack);
+#endif
+    if (memstats_stacks == MemStatsStacks::caller)
+        info.stack = memstats_intern_caller(caller, new_stack);
+#if MEMSTAT_HAVE_TRACE
+    if (memstats_trace) {
+        if (new_stack)
+            memstats_trace->write_stack(*memstats_stack(info.stack));
+        memstats_with_thread_buffer([&](MemStatsThreadBuffer &buffer, std::thread::id thread) {
+            info.thread = thread;
+            memstats_trace->write(buffer.trace_chunk, buffer.index, info);
+        });
+        return;
+    }
+#endif
+    memstats_with_thread_buffer([&](MemStatsThreadBuffer &buffer, std::thread::id thread) {
+        info.thread = thread;
+        buffer.push(std::move(info));
+    });
+}
+
+// What to do with the first allocation over the budget of a thread, besides counting it
+enum class MemStatsBudgetAction { count, log, abort };
+
+MemStatsBudgetAction init_memstats_budget_action() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    if (char *ptr = std::getenv("MEMSTATS_BUDGET_ACTION")) {
+        if (std::strcmp(ptr, "count") == 0)
+            return MemStatsBudgetAction::count;
+        if (std::strcmp(ptr, "log") == 0)
+            return MemStatsBudgetAction::log;
+        if (std::strcmp(ptr, "abort") == 0)
+            return MemStatsBudgetAction::abort;
+        std::cerr << "Option 'MEMSTATS_BUDGET_ACTION=" << ptr << "' not known. Fallback on default 'log'\n";
+    }
+    return MemStatsBudgetAction::log;
+}
+
+static MemStatsBudgetAction memstats_budget_action = init_memstats_budget_action();
+
+/** Budget of a thread between 'memstats_budget_begin' and 'memstats_budget_end'. As the thread flag of
+ * instrumentation, it is only read by its own thread, and being constant-initialized, checking it on each
+ * allocation is a single thread-local load, so budgets can stay in release builds.
+ */
+struct MemStatsThreadBudget {
+    bool active;
+    bool exceeded;
+    std::size_t max_count, max_bytes;
+    std::size_t count, bytes;
+};
+
+MEMSTATS_CONSTINIT static thread_local MemStatsThreadBudget memstats_thread_budget = {};
+// allocations over budget since the last collection, on any thread
+MEMSTATS_CONSTINIT static std::atomic<std::size_t> memstats_over_budget{0};
+MEMSTATS_CONSTINIT static std::atomic<memstats_budget_handler> memstats_budget_callback{nullptr};
+
+// first allocation over the budget of the thread: runs the handler or the action
+MEMSTATS_NOINLINE void memstats_budget_exceeded(std::size_t sz, const void *caller) {
+    const MemStatsReentrancyGuard reentrancy_guard;
+    const MemStatsThreadBudget &budget = memstats_thread_budget;
+    if (memstats_budget_handler handler = memstats_budget_callback.load(std::memory_order_acquire))
+        return handler(budget.count, budget.bytes);
+    if (memstats_budget_action == MemStatsBudgetAction::count)
+        return;
+
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
+    std::cerr << "MemStats budget of " << budget.max_count << " allocations and " << budget.max_bytes
+            << " bytes exceeded by an allocation of " << sz << " bytes in Thread " << std::this_thread::get_id()
+            << ", now " << budget.count << " allocations and " << budget.bytes << " bytes\n";
+    bool inserted = false;
+    std::uint32_t stack = 0;
+#if MEMSTAT_HAVE_STACKS
+    if (memstats_stacks == MemStatsStacks::full)
+        stack = memstats_intern_stack(0, caller, inserted);
+#endif
+    if (memstats_stacks == MemStatsStacks::caller)
+        stack = memstats_intern_caller(caller, inserted);
+#if MEMSTAT_HAVE_TRACE
+    // the next event with this stack will not write it
+    if (inserted and memstats_trace)
+        memstats_trace->write_stack(*memstats_stack(stack));
+#endif
+    if (stack)
+        memstats_print_stack(std::cerr, stack);
+    else
+        std::cerr << "Allocated at " << caller << '\n';
+    if (memstats_budget_action == MemStatsBudgetAction::abort)
+        std::abort();
+}
+
+inline void memstats_budget_charge(std::size_t sz, const void *caller) {
+    MemStatsThreadBudget &budget = memstats_thread_budget;
+    budget.count += 1;
+    budget.bytes += sz;
+    if (budget.count <= budget.max_count and budget.bytes <= budget.max_bytes)
+        return;
+    memstats_over_budget.fetch_add(1, std::memory_order_relaxed);
+    if (!budget.exceeded) {
+        budget.exceeded = true;
+        memstats_budget_exceeded(sz, caller);
+    }
+}
+
+/** Output of the reports: the file of 'MEMSTATS_REPORT_FILE', or the standard output.
+ * Structured reports are written into a buffer allocated once with hand-formatted numbers, and the buffer
+ * goes out with 'fwrite' when it is full and at the end of each report, so that their cost is bounded by
+ * I/O rather than by iostreams. Text reports to a file go through the same buffer, text reports to the
+ * standard output keep using 'std::cout' to stay in order with the output of the program.
+ * Created by the first report and never destroyed, since reports run at exit. Requires 'memstats_lock'.
+ */
+class MemStatsReportWriter : public std::streambuf {
+public:
+    static MemStatsReportWriter &get();
+
+    std::ostream &text() {
+        return file == stdout ? std::cout : stream;
+    }
+
+    void put(char c) {
+        if (pptr() == epptr())
+            write_out();
+        *pptr() = c;
+        pbump(1);
+    }
+
+    void put(const char *str) {
+        sputn(str, static_cast<std::streamsize>(std::strlen(str)));
+    }
+
+    void integer(std::uint64_t value);
+    void number(double value);
+    // 'str' as a JSON string or a CSV field, depending on 'memstats_report_format'
+    void quoted(const char *str);
+    // writes out the buffer and flushes the file
+    void finish();
+
+    bool csv_header = false; // whether the CSV header was written
+
+private:
+    explicit MemStatsReportWriter(std::FILE *file) : file{file}, stream{this} {
+        setp(buffer, buffer + sizeof(buffer));
+    }
+
+    int_type overflow(int_type c) override;
+    int sync() override;
+    void write_out();
+
+    std::FILE *file;
+    std::ostream stream;
+    char buffer[1 << 16];
+};
+
+MemStatsReportWriter &MemStatsReportWriter::get() {
+    static MemStatsReportWriter *writer = [] {
+        std::FILE *file = stdout;
+        const char *path = std::getenv("MEMSTATS_REPORT_FILE");
+        if (path and *path and !(file = std::fopen(path, "w"))) {
+            std::cerr << "Option 'MEMSTATS_REPORT_FILE=" << path << "' could not be opened: " << std::strerror(errno)
+                    << ". Fallback on standard output\n";
+            file = stdout;
+        }
+        return ::new(memstats_raw_malloc(sizeof(MemStatsReportWriter))) MemStatsReportWriter{file};
+    }();
+    return *writer;
+}
+
+void MemStatsReportWriter::integer(std::uint64_t value) {
+    char digits[20];
+    std::size_t count = 0;
+    do {
+        digits[count++] = char('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (count)
+        put(digits[--count]);
+}
+
+void MemStatsReportWriter::number(double value) {
+    // counts are only fractional when estimated from samples
+    if (value >= 0 and value < 1e15 and value == std::floor(value))
+        return integer(static_cast<std::uint64_t>(value));
+    char digits[32];
+    const int length = std::snprintf(digits, sizeof(digits), "%.3f", value);
+    sputn(digits, length);
+}
+
+void MemStatsReportWriter::quoted(const char *str) {
+    put('"');
+    for (; *str; ++str) {
+        const unsigned char c = static_cast<unsigned char>(*str);
+        if (memstats_report_format == MemStatsReportFormat::csv) {
+            if (c == '"')
+                put('"');
+            put(*str);
+        } else if (c == '"' or c == '\\') {
+            put('\\');
+            put(*str);
+        } else if (c < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            put("\\u00");
+            put(hex[c >> 4]);
+            put(hex[c & 0xf]);
+        } else {
+            put(*str);
+        }
+    }
+    put('"');
+}
+
+void MemStatsReportWriter::write_out() {
+    std::fwrite(pbase(), 1, static_cast<std::size_t>(pptr() - pbase()), file);
+    setp(buffer, buffer + sizeof(buffer));
+}
+
+void MemStatsReportWriter::finish() {
+    stream.flush();
+    write_out();
+    std::fflush(file);
+}
+
+MemStatsReportWriter::int_type MemStatsReportWriter::overflow(int_type c) {
+    write_out();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+        put(traits_type::to_char_type(c));
+    return traits_type::not_eof(c);
+}
+
+int MemStatsReportWriter::sync() {
+    write_out();
+    return 0;
+}
+
+void print_legend() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    MemStatsReportWriter &writer = MemStatsReportWriter::get();
+    memstats_print_legend(writer.text());
+    writer.finish();
+}
+
+// event of the analyses shared with 'memstats-analyze'
+MemStatsEvent<std::thread::id> memstats_event(const MemStatsInfo &info) {
+    return MemStatsEvent<std::thread::id>{reinterpret_cast<std::uintptr_t>(info.ptr), info.size, info.time, info.thread,
+                                          info.stack, info.form};
+}
+
+using MemStatsErrors = MemStatsMemoryErrors<std::thread::id, MallocAllocator>;
+
+// Matches frees to allocations in one pass over the time-ordered events, regardless of the freeing thread
+MemStatsErrors memstats_find_memory_errors(const MemStatsEvents &memstats_events) {
+    MemStatsErrors errors;
+    for (const MemStatsInfo &info: memstats_events)
+        errors.add(memstats_event(info));
+    errors.finish();
+    return errors;
+}
+
+// innermost frame of the stack of id 'id', or 0 if unknown
+std::uint64_t memstats_site(std::uint32_t id) {
+    const MemStatsStack *stack = memstats_stack(id);
+    return stack and stack->depth ? stack->frames()[0] : 0;
+}
+
+void report_memory_errors(const MemStatsEvents &memstats_events) {
+    const MemStatsErrors errors = memstats_find_memory_errors(memstats_events);
+    std::ostream &out = MemStatsReportWriter::get().text();
+
+    out << "\nMemory leaks:\n";
+
+    // Report allocations without deallocations
+    for (const MemStatsEvent<std::thread::id> &leak: errors.leaks) {
+        out << "Pointer " << memstats_pointer(leak.ptr) << " was never freed in Thread " << leak.thread << "."
+                << std::endl;
+        if (leak.stack) {
+            out << "Current stacktrace:\n";
+            memstats_print_stack(out, leak.stack);
+        }
+    }
+
+    out << "\nDouble freed pointers:\n";
+
+    // Report double deallocations
+    for (const auto &entry: errors.double_frees)
+        out << "Pointer " << memstats_pointer(entry.first) << " was freed " << entry.second << " times." << std::endl;
+
+    out << "\nMismatched new/delete pointers:\n";
+
+    for (const auto &mismatch: errors.mismatches)
+        out << "Pointer " << memstats_pointer(mismatch.allocation.ptr) << " was allocated with '"
+                << memstats_form_name(true, mismatch.allocation.form) << "' and freed with '"
+                << memstats_form_name(false, mismatch.free_form) << "'." << std::endl;
+}
+
+/** Follows the bytes that are live, i.e. allocated and not freed yet, over the time-ordered events.
+ * Prints the peak with a timeline of the live bytes in total and per allocating thread, and the allocation sites
+ * holding the most memory at the moment of the peak.
+ */
+void report_live_memory(const MemStatsEvents &memstats_events) {
+    if (memstats_events.empty())
+        return;
+
+    MemStatsLiveMemory<std::thread::id, MallocAllocator> live(memstats_bins(), memstats_events.front().time,
+                                                              memstats_events.back().time);
+    for (const MemStatsInfo &info: memstats_events)
+        live.add(memstats_event(info));
+    if (!live.global.peak)
+        return;
+    live.finish();
+
+    std::ostream &out = MemStatsReportWriter::get().text();
+    const auto str_precentage = memstats_str_hist_representation();
+    out << "\nLive memory:\n";
+    memstats_format_sparkline(out, live.global.timeline, double(live.global.peak), str_precentage);
+    out << " | " << std::right << std::setw(6) << memstats_bytes_to_string(double(live.global.current))
+            << " at end | Total\n";
+    for (const auto &pair: live.threads)
+        if (pair.second.peak) {
+            memstats_format_sparkline(out, pair.second.timeline, double(pair.second.peak), str_precentage);
+            out << " | " << std::right << std::setw(6)
+                    << memstats_bytes_to_string(double(pair.second.current)) << " at end | Thread " << pair.first
+                    << std::endl;
+        }
+
+    // replay up to the peak, and group what is live then by the innermost frame of its stack
+    MemStatsLiveStacks<std::thread::id, MallocAllocator> peak_stacks;
+    for (std::size_t i = 0; i != live.peak_events; ++i)
+        peak_stacks.add(memstats_event(memstats_events[i]));
+    using Site = std::pair<std::uint32_t, std::uint64_t>; // a stack of the site and its live bytes
+    const auto sites = memstats_group_by_site<std::uint64_t, MallocAllocator>(peak_stacks.stacks(), memstats_site);
+    std::vector<Site, MallocAllocator<Site> > top;
+    for (const auto &pair: sites)
+        top.push_back(pair.second);
+    const std::size_t top_sites = std::min<std::size_t>(top.size(), 10);
+    std::partial_sort(top.begin(), top.begin() + top_sites, top.end(),
+                      [](const Site &a, const Site &b) { return a.second > b.second; });
+    if (top_sites)
+        out << "\nTop allocation sites at peak:\n";
+    for (std::size_t i = 0; i != top_sites; ++i)
+        out << std::right << std::setw(6) << memstats_bytes_to_string(double(top[i].second)) << " ("
+                << std::setw(3) << top[i].second * 100 / live.global.peak << "%) | "
+                << memstats_symbolize(*memstats_stack(top[i].first), 0) << std::endl;
+}
+
+/** Pairs each free with its allocation and reports the time between them: in total, per allocating thread
+ * and per allocation site (innermost frame of the stack), and flags sites where most allocations are short-lived.
+ */
+void report_lifetimes(const MemStatsEvents &memstats_events) {
+    using Lifetimes = MemStatsLifetimes<MallocAllocator>;
+    MemStatsLifetimeAnalysis<std::thread::id, MallocAllocator> lifetimes(memstats_ticks_to_ns(1));
+    for (const MemStatsInfo &info: memstats_events)
+        lifetimes.add(memstats_event(info));
+    if (!lifetimes.total.count)
+        return;
+    const auto site_lifetimes = memstats_group_by_site<Lifetimes, MallocAllocator>(lifetimes.stacks, memstats_site);
+
+    std::ostream &out = MemStatsReportWriter::get().text();
+    const auto str_precentage = memstats_str_hist_representation();
+    std::vector<double, MallocAllocator<double> > hist(memstats_bins());
+    std::vector<std::pair<std::uint64_t, double>, MallocAllocator<std::pair<std::uint64_t, double> > > sorted;
+    auto format_line = [&](const Lifetimes &lifetimes) -> std::ostream & {
+        const std::uint64_t median = memstats_lifetime_median(sorted, lifetimes.lifetime_freq, lifetimes.count);
+        return memstats_format_lifetime_line(out, hist, lifetimes.lifetime_freq, lifetimes.max, median,
+                                             lifetimes.count, str_precentage);
+    };
+
+    out << "\nAllocation lifetimes:\n";
+    format_line(lifetimes.total) << "Total\n";
+    for (const auto &pair: lifetimes.threads)
+        format_line(pair.second) << "Thread " << pair.first << std::endl;
+
+    // a stack of each site, to name it, and its lifetimes
+    using Site = const std::pair<std::uint32_t, Lifetimes> *;
+    std::vector<Site, MallocAllocator<Site> > sites;
+    for (const auto &pair: site_lifetimes)
+        sites.push_back(&pair.second);
+    std::sort(sites.begin(), sites.end(), [](Site a, Site b) { return a->second.count > b->second.count; });
+    for (Site site: sites)
+        format_line(site->second) << memstats_symbolize(*memstats_stack(site->first), 0) << std::endl;
+
+    bool header = false;
+    for (Site site: sites)
+        if (2 * site->second.short_lived > site->second.count) {
+            if (!header)
+                out << "\nShort-lived allocation sites (most allocations freed within "
+                        << memstats_duration_to_string(double(memstats_short_lifetime)) << "):\n";
+            header = true;
+            out << std::right << std::setw(3) << std::llround(100 * site->second.short_lived / site->second.count)
+                    << "% of " << std::left << std::setw(5) << memstats_int_to_string(site->second.count) << " | "
+                    << memstats_symbolize(*memstats_stack(site->first), 0) << std::endl;
+        }
+}
+
+// counts and sizes are estimates when sampling
+struct MemStatsStats {
+    double count{0}, size{0};
+    std::size_t max_size{0};
+    unordered_map<std::size_t, double> size_freq;
+
+    void add(const MemStatsStats &other) {
+        count += other.count;
+        size += other.size;
+        max_size = std::max(max_size, other.max_size);
+        for (const auto &frec: other.size_freq)
+            size_freq[frec.first] += frec.second;
+    }
+};
+
+// statistics of the events of one epoch, or accumulated over several epochs
+struct MemStatsTotals {
+    MemStatsStats global;
+    unordered_map<std::thread::id, MemStatsStats> threads;
+    unordered_map<std::uint32_t, MemStatsStats> stacks;
+    unordered_map<std::uint32_t, MemStatsStats> regions;
+    std::size_t frees = 0;
+    std::size_t over_budget = 0; // allocations over the budget of their thread
+    std::size_t dropped = 0;     // events dropped by the ring of 'MEMSTATS_EVENT_RING'
+
+    bool empty() const {
+        return global.count == 0 and frees == 0 and over_budget == 0 and dropped == 0;
+    }
+
+    void add(const MemStatsTotals &other) {
+        global.add(other.global);
+        for (const auto &pair: other.threads)
+            threads[pair.first].add(pair.second);
+        for (const auto &pair: other.stacks)
+            stacks[pair.first].add(pair.second);
+        for (const auto &pair: other.regions)
+            regions[pair.first].add(pair.second);
+        frees += other.frees;
+        over_budget += other.over_budget;
+        dropped += other.dropped;
+    }
+
+    void add(const MemStatsInfo &info) {
+        const double weight = info.size ? memstats_sample_weight(info.size) : 0.;
+        auto register_stats = [&](MemStatsStats &stats) {
+            stats.count += weight;
+            stats.size += weight * double(info.size);
+            stats.max_size = std::max(stats.max_size, info.size);
+            if (info.size)
+                stats.size_freq[info.size] += weight;
+        };
+
+        register_stats(global);
+        register_stats(threads[info.thread]);
+        if (info.stack)
+            register_stats(stacks[info.stack]);
+        if (info.region)
+            register_stats(regions[info.region]);
+        frees += !info.size;
+    }
+};
+
+/** Detaches the epoch of everything the threads published since the last collection and adds it to 'epoch',
+ * and its events to 'events' in time order. Threads keep recording meanwhile: they never wait for the
+ * collection, which only takes what they published. Requires 'memstats_lock'.
+ */
+void memstats_collect_epoch(MemStatsTotals &epoch, MemStatsEvents &events) {
+    epoch.over_budget += memstats_over_budget.exchange(0, std::memory_order_relaxed);
+    epoch.dropped += memstats_dropped_events.exchange(0, std::memory_order_relaxed);
+    if (memstats_mode == MemStatsMode::aggregate) {
+        // rebuild the size frequencies from the log2 bins, each bin represented by its middle size
+        memstats_for_each_buffer([&](MemStatsThreadBuffer &buffer) {
+            MemStatsCounters &counters = buffer.counters;
+            MemStatsCounterValues &read = buffer.counters_read;
+            MemStatsStats &stats = epoch.threads[buffer.thread];
+            // whatever the thread adds meanwhile is reported by the next collection, even if the counters
+            // of one allocation are split between both
+            auto since_read = [](const std::atomic<double> &counter, double &last) {
+                const double value = counter.load(std::memory_order_relaxed);
+                const double delta = value - last;
+                last = value;
+                return delta;
+            };
+            std::size_t max_size = counters.max_size.exchange(0, std::memory_order_relaxed);
+            double bins[memstats_size_bins];
+            for (std::size_t bin = 0; bin != memstats_size_bins; ++bin)
+                // the maximum may be published after the bin of the same size
+                if ((bins[bin] = since_read(counters.size_bins[bin], read.size_bins[bin])))
+                    max_size = std::max(max_size, std::size_t(1) << bin);
+            const double count = since_read(counters.count, read.count);
+            const double size = since_read(counters.size, read.size);
+            for (MemStatsStats *target: {&epoch.global, &stats}) {
+                target->count += count;
+                target->size += size;
+                target->max_size = std::max(target->max_size, max_size);
+            }
+            for (std::size_t bin = 0; bin != memstats_size_bins; ++bin)
+                if (bins[bin]) {
+                    const std::size_t size = std::min(max_size, (std::size_t(3) << bin) >> 1);
+                    epoch.global.size_freq[size] += bins[bin];
+                    stats.size_freq[size] += bins[bin];
+                }
+            const std::size_t frees = counters.frees.load(std::memory_order_relaxed);
+            epoch.frees += frees - read.frees;
+            read.frees = frees;
+        });
+        return;
+    }
+    const std::size_t first = events.size();
+    memstats_drain_events(events);
+    for (std::size_t i = first; i != events.size(); ++i)
+        epoch.add(events[i]);
+    // an event of this epoch may be older than an event of the previous ones if its thread published it late
+    std::inplace_merge(events.begin(), events.begin() + first, events.end(),
+                       [](const MemStatsInfo &a, const MemStatsInfo &b) { return a.time < b.time; });
+}
+
+/** What snapshots collected since the last report: their accumulated statistics, and their events, which
+ * the next report still analyzes. Created by the first snapshot and never destroyed, since reports run at exit.
+ * Requires 'memstats_lock'.
+ */
+struct MemStatsSnapshots {
+    MemStatsTotals totals;
+    MemStatsEvents events;
+    bool events_dropped = false; // events were counted and dropped by 'MEMSTATS_REPORT_INTERVAL_MS'
+};
+
+static MemStatsSnapshots *memstats_snapshots = nullptr;
+
+// calls 'f(path, stats)' for each region with allocations, where each event also counts for the regions around its own
+template<class F>
+void memstats_for_each_region(const MemStatsTotals &totals, F &&f) {
+    unordered_map<std::uint32_t, MemStatsStats> region_total_stats;
+    for (const auto &pair: totals.regions)
+        for (const MemStatsRegionNode *region = memstats_region(pair.first); region;
+             region = memstats_region(region->parent))
+            region_total_stats[region->id].add(pair.second);
+    // sorted by path, so that nested regions follow the region around them
+    using RegionLine = std::pair<string, const MemStatsStats *>;
+    std::vector<RegionLine, MallocAllocator<RegionLine> > regions;
+    for (const auto &pair: region_total_stats)
+        if (pair.second.size)
+            regions.emplace_back(memstats_region_path(pair.first), &pair.second);
+    std::sort(regions.begin(), regions.end());
+    for (const auto &region: regions)
+        f(region.first, *region.second);
+}
+
+// calls 'f(name, stats)' for each stack entry with allocations, where each event counts for every entry of its stack
+template<class F>
+void memstats_for_each_stack_entry(const MemStatsTotals &totals, F &&f) {
+    // expand once per distinct stack instead of once per event
+    struct EntryStats {
+        const MemStatsStack *stack; // a stack with the entry, and its position, to name it
+        std::size_t position;
+        MemStatsStats stats;
     };
+    unordered_map<std::uintptr_t, EntryStats> stack_entry_stats;
+    for (const auto &pair: totals.stacks)
+        if (const MemStatsStack *stack = memstats_stack(pair.first))
+            for (std::size_t i = 0; i != stack->depth; ++i)
+                stack_entry_stats.emplace(stack->frames()[i], EntryStats{stack, i, {}}).first->second.stats.add(
+                    pair.second);
+    std::vector<std::pair<std::uint64_t, const MemStatsStats *>,
+                MallocAllocator<std::pair<std::uint64_t, const MemStatsStats *> > > entries;
+    for (const auto &pair: stack_entry_stats)
+        if (pair.second.stats.size)
+            entries.emplace_back(pair.first, &pair.second.stats);
+    memstats_sort_stack_entries(entries);
+    for (const auto &entry: entries) {
+        const EntryStats &found = stack_entry_stats.find(entry.first)->second;
+        f(memstats_symbolize(*found.stack, found.position), found.stats);
+    }
+}
+
+// histograms in total, per thread, per region and per stack entry
+void memstats_print_totals(const MemStatsTotals &totals) {
+    std::ostream &out = MemStatsReportWriter::get().text();
+    const auto str_precentage = memstats_str_hist_representation();
+    std::vector<double, MallocAllocator<double> > hist(memstats_bins());
+
+    if (memstats_sample_rate)
+        out << "Estimated from allocations sampled every "
+                << memstats_bytes_to_string(double(memstats_sample_rate)) << " on average\n";
+    if (totals.over_budget)
+        out << totals.over_budget << " allocations over the budget of their thread\n";
+    if (totals.dropped)
+        out << "Last events only: " << totals.dropped << " older events were dropped by the ring\n";
 
-    std::cout << format_histogram(global_stats) << " | " << std::right
-            << std::setw(6) << bytes_to_string(global_stats.size) << '('
-            << std::left << std::setw(5) << int_to_string(global_stats.count)
-            << ") | Total\n";
+    memstats_format_line(out, hist, totals.global.size_freq, totals.global.max_size, totals.global.size,
+                         totals.global.count, str_precentage) << "Total\n";
 
-    for (const auto &pair: thread_stats)
+    for (const auto &pair: totals.threads)
         if (pair.second.size) {
-            std::cout << format_histogram(pair.second) << " | " << std::right
-                    << std::setw(6) << bytes_to_string(pair.second.size) << '('
-                    << std::left << std::setw(5) << int_to_string(pair.second.count)
-                    << ") | Thread " << pair.first << std::endl;
+            memstats_format_line(out, hist, pair.second.size_freq, pair.second.max_size, pair.second.size,
+                                 pair.second.count, str_precentage) << "Thread " << pair.first << std::endl;
         }
 
-#if MEMSTAT_HAVE_STACKTRACE
-    for (auto [stacktrace_entry, stats] : stacktrace_entry_stats)
-    {
-      if (stats.size) {
-        std::cout << format_histogram(stats) << " | " << std::right
-                  << std::setw(6) << bytes_to_string(stats.size) << '('
-                  << std::left << std::setw(5)
-                  << int_to_string(stats.count) << ") | ";
-        std::cout << stacktrace_entry << std::endl;
-      }
+    memstats_for_each_region(totals, [&](const string &path, const MemStatsStats &stats) {
+        memstats_format_line(out, hist, stats.size_freq, stats.max_size, stats.size, stats.count, str_precentage)
+                << "Region " << path << std::endl;
+    });
+
+    memstats_for_each_stack_entry(totals, [&](const string &name, const MemStatsStats &stats) {
+        memstats_format_line(out, hist, stats.size_freq, stats.max_size, stats.size, stats.count, str_precentage)
+                << name << std::endl;
+    });
+}
+
+// label of a thread in the reports, as printed by 'std::thread::id'
+string memstats_thread_name(std::thread::id thread) {
+    stringstream stream;
+    stream << thread;
+    return stream.str();
+}
+
+/** Report for other programs, with 'MEMSTATS_REPORT_FORMAT=json|csv': the statistics in total, per thread,
+ * per region and per stack entry with the raw bins of their histograms, and the memory errors of 'events'
+ * if given. 'kind' is 'report', 'snapshot', 'delta' or 'interval'.
+ * JSON writes one object per report, on one line. CSV writes rows of 'report,kind,record,name,size,count,bytes':
+ * records 'total', 'thread', 'region' and 'site' have the largest allocation as 'size' and are followed by
+ * one '<record>_bin' row per allocation size, then come the records 'leak', 'double_free' and 'mismatch'.
+ */
+void memstats_write_structured(const char *name, const char *kind, const MemStatsTotals &totals,
+                               const MemStatsEvents *events) {
+    MemStatsReportWriter &writer = MemStatsReportWriter::get();
+    const bool json = memstats_report_format == MemStatsReportFormat::json;
+    std::vector<std::pair<std::size_t, double>, MallocAllocator<std::pair<std::size_t, double> > > bins;
+    char pointer[32];
+    auto pointer_name = [&](const void *ptr) -> const char * {
+        std::snprintf(pointer, sizeof(pointer), "%p", ptr);
+        return pointer;
+    };
+
+    // start of a CSV row, up to its name
+    auto row = [&](const char *record, const char *row_name) {
+        writer.quoted(name);
+        writer.put(',');
+        writer.put(kind);
+        writer.put(',');
+        writer.put(record);
+        writer.put(',');
+        writer.quoted(row_name);
+        writer.put(',');
+    };
+    auto row_end = [&](double size, double count, double bytes) {
+        writer.number(size);
+        writer.put(',');
+        writer.number(count);
+        writer.put(',');
+        writer.number(bytes);
+        writer.put('\n');
+    };
+    // statistics as the members of a JSON object, or as CSV rows
+    auto write_stats = [&](const char *record, const char *bin_record, const char *stats_name,
+                           const MemStatsStats &stats) {
+        bins.assign(stats.size_freq.begin(), stats.size_freq.end());
+        std::sort(bins.begin(), bins.end());
+        if (!json) {
+            row(record, stats_name);
+            row_end(double(stats.max_size), stats.count, stats.size);
+            for (const auto &bin: bins) {
+                row(bin_record, stats_name);
+                row_end(double(bin.first), bin.second, double(bin.first) * bin.second);
+            }
+            return;
+        }
+        writer.put("\"count\":");
+        writer.number(stats.count);
+        writer.put(",\"bytes\":");
+        writer.number(stats.size);
+        writer.put(",\"max_size\":");
+        writer.integer(stats.max_size);
+        writer.put(",\"histogram\":[");
+        for (std::size_t i = 0; i != bins.size(); ++i) {
+            writer.put(i ? ",[" : "[");
+            writer.integer(bins[i].first);
+            writer.put(',');
+            writer.number(bins[i].second);
+            writer.put(']');
+        }
+        writer.put(']');
+    };
+    // JSON array 'key' of objects with the member 'member' naming them
+    std::size_t entries = 0;
+    auto begin_array = [&](const char *key) {
+        entries = 0;
+        if (json) {
+            writer.put(",\"");
+            writer.put(key);
+            writer.put("\":[");
+        }
+    };
+    auto begin_entry = [&](const char *member, const char *entry_name) {
+        if (json) {
+            writer.put(entries++ ? ",{\"" : "{\"");
+            writer.put(member);
+            writer.put("\":");
+            writer.quoted(entry_name);
+            writer.put(',');
+        }
+    };
+    auto end_entry = [&] {
+        if (json)
+            writer.put('}');
+    };
+    auto end_array = [&] {
+        if (json)
+            writer.put(']');
+    };
+
+    if (json) {
+        writer.put("{\"report\":");
+        writer.quoted(name);
+        writer.put(",\"kind\":\"");
+        writer.put(kind);
+        writer.put("\",\"sample_rate\":");
+        writer.integer(memstats_sample_rate);
+        writer.put(",\"frees\":");
+        writer.integer(totals.frees);
+        writer.put(",\"over_budget\":");
+        writer.integer(totals.over_budget);
+        writer.put(",\"dropped\":");
+        writer.integer(totals.dropped);
+        writer.put(",\"total\":{");
+        write_stats("total", "total_bin", "", totals.global);
+        writer.put('}');
+    } else {
+        if (!writer.csv_header)
+            writer.put("report,kind,record,name,size,count,bytes\n");
+        writer.csv_header = true;
+        write_stats("total", "total_bin", "", totals.global);
+        row("frees", "");
+        row_end(0, double(totals.frees), 0);
+        row("over_budget", "");
+        row_end(0, double(totals.over_budget), 0);
+        row("dropped", "");
+        row_end(0, double(totals.dropped), 0);
+    }
+
+    begin_array("threads");
+    for (const auto &pair: totals.threads)
+        if (pair.second.size) {
+            const string thread = memstats_thread_name(pair.first);
+            begin_entry("thread", thread.c_str());
+            write_stats("thread", "thread_bin", thread.c_str(), pair.second);
+            end_entry();
+        }
+    end_array();
+
+    begin_array("regions");
+    memstats_for_each_region(totals, [&](const string &path, const MemStatsStats &stats) {
+        begin_entry("region", path.c_str());
+        write_stats("region", "region_bin", path.c_str(), stats);
+        end_entry();
+    });
+    end_array();
+
+    begin_array("sites");
+    memstats_for_each_stack_entry(totals, [&](const string &site, const MemStatsStats &stats) {
+        begin_entry("site", site.c_str());
+        write_stats("site", "site_bin", site.c_str(), stats);
+        end_entry();
+    });
+    end_array();
+
+    if (events) {
+        const MemStatsErrors errors = memstats_find_memory_errors(*events);
+        begin_array("leaks");
+        for (const MemStatsEvent<std::thread::id> &info: errors.leaks) {
+            const MemStatsStack *stack = memstats_stack(info.stack);
+            const char *site = stack and stack->depth ? memstats_symbolize(*stack, 0).c_str() : "";
+            if (!json) {
+                row("leak", site);
+                row_end(double(info.size), 1, double(info.size));
+                continue;
+            }
+            begin_entry("ptr", pointer_name(memstats_pointer(info.ptr)));
+            writer.put("\"size\":");
+            writer.integer(info.size);
+            writer.put(",\"thread\":");
+            writer.quoted(memstats_thread_name(info.thread).c_str());
+            writer.put(",\"site\":");
+            writer.quoted(site);
+            end_entry();
+        }
+        end_array();
+
+        begin_array("double_frees");
+        for (const auto &entry: errors.double_frees) {
+            if (!json) {
+                row("double_free", pointer_name(memstats_pointer(entry.first)));
+                row_end(0, double(entry.second), 0);
+                continue;
+            }
+            begin_entry("ptr", pointer_name(memstats_pointer(entry.first)));
+            writer.put("\"times\":");
+            writer.integer(entry.second);
+            end_entry();
+        }
+        end_array();
+
+        begin_array("mismatches");
+        for (const auto &entry: errors.mismatches) {
+            const MemStatsEvent<std::thread::id> &allocation = entry.allocation;
+            const char *allocated = memstats_form_name(true, allocation.form);
+            const char *freed = memstats_form_name(false, entry.free_form);
+            if (!json) {
+                row("mismatch", (string(allocated) + '/' + freed).c_str());
+                row_end(double(allocation.size), 1, double(allocation.size));
+                continue;
+            }
+            begin_entry("ptr", pointer_name(memstats_pointer(allocation.ptr)));
+            writer.put("\"allocation\":");
+            writer.quoted(allocated);
+            writer.put(",\"deallocation\":");
+            writer.quoted(freed);
+            end_entry();
+        }
+        end_array();
     }
+
+    if (json)
+        writer.put("}\n");
+    writer.finish();
+}
+
+void memstats_snapshot(const char *snapshot_name, bool delta) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    const MemStatsReentrancyGuard reentrancy_guard;
+    // only serializes reporting threads: recording threads never take this lock
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
+    if (!memstats_snapshots)
+        memstats_snapshots = ::new(memstats_raw_malloc(sizeof(MemStatsSnapshots))) MemStatsSnapshots{};
+    MemStatsTotals epoch;
+    memstats_collect_epoch(epoch, memstats_snapshots->events);
+    // events are only kept for the analyses of the report, which need the history of each pointer
+    if (memstats_mode != MemStatsMode::events or memstats_sample_rate)
+        memstats_snapshots->events.clear();
+    memstats_snapshots->totals.add(epoch);
+
+    const MemStatsTotals &totals = delta ? epoch : memstats_snapshots->totals;
+    if (totals.empty())
+        return;
+    if (memstats_report_format != MemStatsReportFormat::text)
+        return memstats_write_structured(snapshot_name, delta ? "delta" : "snapshot", totals, nullptr);
+    MemStatsReportWriter &writer = MemStatsReportWriter::get();
+    writer.text() << "\n------------------- MemStats " << snapshot_name << (delta ? " (delta)" : " (cumulative)")
+            << " -------------------\n";
+    memstats_print_totals(totals);
+    writer.finish();
+}
+
+void memstats_report(const char *report_name) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
 #endif
 
-    report_memory_leaks();
+    const MemStatsReentrancyGuard reentrancy_guard;
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
+    // a report covers the snapshots taken since the last report, and starts a new period
+    MemStatsTotals totals;
+    MemStatsEvents memstats_events;
+    if (memstats_snapshots) {
+        std::swap(totals, memstats_snapshots->totals);
+        memstats_events.swap(memstats_snapshots->events);
+    }
+    MemStatsTotals epoch;
+    memstats_collect_epoch(epoch, memstats_events);
+    totals.add(epoch);
+    if (memstats_events.empty() and totals.empty())
+        return;
+
+    // live bytes, lifetimes, leaks and double frees need the history of each pointer, which is not kept in aggregate or sampling mode
+    const bool analyze_events = memstats_mode == MemStatsMode::events and !memstats_sample_rate;
+    // without timestamps, events of different threads are not ordered, so neither is the history of a pointer
+    const bool ordered_events = memstats_clock != MemStatsClock::none;
+    // events dropped by the interval reports leave the history of their pointers incomplete
+    const bool complete_events = !memstats_snapshots or !memstats_snapshots->events_dropped;
+    if (memstats_report_format != MemStatsReportFormat::text)
+        return memstats_write_structured(report_name, "report", totals,
+                                         analyze_events and ordered_events and complete_events ? &memstats_events
+                                                                                               : nullptr);
+
+    MemStatsReportWriter &writer = MemStatsReportWriter::get();
+    writer.text() << "\n------------------- MemStats " << report_name << " -------------------\n";
+    memstats_print_totals(totals);
+
+    if (analyze_events and ordered_events and complete_events) {
+        report_live_memory(memstats_events);
+        report_lifetimes(memstats_events);
+        report_memory_errors(memstats_events);
+    } else if (analyze_events and !ordered_events) {
+        writer.text() << "\nLive memory, lifetimes and memory errors are not reported with 'MEMSTATS_CLOCK=none'\n";
+    } else if (analyze_events) {
+        writer.text() << "\nLive memory, lifetimes and memory errors are not reported with "
+                "'MEMSTATS_REPORT_INTERVAL_MS', which drops the events of each interval\n";
+    }
+    writer.finish();
+
+    // avoid printing legend several times, so call once at exit
+    static std::once_flag legend_flag;
+    std::call_once(legend_flag, []() { std::atexit(print_legend); });
+}
 
-    std::cout << "\nDouble freed pointers:\n";
+// one line per interval of 'MEMSTATS_REPORT_INTERVAL_MS': what was allocated and freed, and at which rate
+void memstats_report_interval(double seconds, double elapsed) {
+    const MemStatsReentrancyGuard reentrancy_guard;
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
+    if (!memstats_snapshots)
+        memstats_snapshots = ::new(memstats_raw_malloc(sizeof(MemStatsSnapshots))) MemStatsSnapshots{};
+    // the events of the interval are dropped once aggregated, so that memory stays bounded
+    MemStatsTotals epoch;
+    MemStatsEvents events;
+    memstats_collect_epoch(epoch, events);
+    memstats_snapshots->totals.add(epoch);
+    memstats_snapshots->events_dropped |= !events.empty();
+
+    if (memstats_report_format != MemStatsReportFormat::text) {
+        // named by the seconds elapsed since the reporter started
+        char name[32];
+        std::snprintf(name, sizeof(name), "%.3f", elapsed);
+        return memstats_write_structured(name, "interval", epoch, nullptr);
+    }
+    const MemStatsStats &stats = epoch.global;
+    MemStatsReportWriter::get().text() << "MemStats interval " << std::left << std::setw(6) << memstats_duration_to_string(elapsed * 1e9)
+            << " | " << std::right << std::setw(6) << memstats_int_to_string(stats.count) << " allocations ("
+            << memstats_int_to_string(stats.count / seconds) << "/s) | " << std::setw(6)
+            << memstats_bytes_to_string(stats.size) << " (" << memstats_bytes_to_string(stats.size / seconds)
+            << "/s) | " << memstats_int_to_string(double(epoch.frees)) << " frees" << std::endl;
+    MemStatsReportWriter::get().finish();
+}
 
-    // Report double deallocations
-    for (const auto &entry: ptr_stats) {
-        if (entry.times_freed > 1)
-            std::cout << "Pointer " << entry.ptr << " was freed " << entry.times_freed << " times." << std::endl;
+/** Reporter thread of 'MEMSTATS_REPORT_INTERVAL_MS'. It never records its own allocations, and is stopped
+ * at exit before the report at exit, since it is started after the report is registered.
+ */
+struct MemStatsReporter {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stop = false;
+
+    void run(std::chrono::milliseconds interval) {
+        memstats_reentrant = true;
+        const auto start = std::chrono::steady_clock::now();
+        auto last = start;
+        std::unique_lock<std::mutex> lk{mutex};
+        while (!wake.wait_for(lk, interval, [this] { return stop; })) {
+            const auto now = std::chrono::steady_clock::now();
+            const std::chrono::duration<double> seconds = now - last, elapsed = now - start;
+            last = now;
+            memstats_report_interval(seconds.count(), elapsed.count());
+        }
     }
+};
 
-    // clean up vector
-    memstats_events.clear();
+bool init_memstats_reporter() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
 
-    // avoid printing legend several times, so call once at exit
-    static std::once_flag legend_flag;
-    std::call_once(legend_flag, []() { std::atexit(print_legend); });
+    const char *ptr = std::getenv("MEMSTATS_REPORT_INTERVAL_MS");
+    if (!ptr)
+        return false;
+    char *end = nullptr;
+    const unsigned long interval = std::strtoul(ptr, &end, 10);
+    if (end == ptr or *end) {
+        std::cerr << "Option 'MEMSTATS_REPORT_INTERVAL_MS=" << ptr << "' not known. Fallback on default '0'\n";
+        return false;
+    }
+    if (!interval)
+        return false;
+    if (memstats_trace) {
+        std::cerr << "Option 'MEMSTATS_REPORT_INTERVAL_MS' is ignored with 'MEMSTATS_TRACE_FILE'\n";
+        return false;
+    }
+    const MemStatsReentrancyGuard reentrancy_guard;
+    // never destroyed: the thread is only joined at exit
+    static MemStatsReporter *reporter = ::new(memstats_raw_malloc(sizeof(MemStatsReporter))) MemStatsReporter{};
+    reporter->thread = std::thread{&MemStatsReporter::run, reporter, std::chrono::milliseconds(interval)};
+    std::atexit([] {
+        {
+            std::lock_guard<std::mutex> lk{reporter->mutex};
+            reporter->stop = true;
+        }
+        reporter->wake.notify_one();
+        reporter->thread.join();
+    });
+    return true;
 }
 
+static const bool memstats_reporter_guard = init_memstats_reporter();
+
 template<class T, class U = T>
 T exchange(T &obj, U &&new_value) {
 #if MEMSTATS_USE_MEMORY_TRACER
@@ -544,74 +2743,530 @@ bool memstats_disable_thread_instrumentation() {
     return exchange(memstats_instrumentation_thread, false);
 }
 
-bool memstats_do_instrument() {
+void memstats_region_begin(const char *name) {
 #if MEMSTATS_USE_MEMORY_TRACER
     const MemoryTracerGuard guard;
 #endif
 
-    return memstats_instrumentation_thread and memstats_instrumentation_global.load(std::memory_order_acquire);
+    const std::size_t depth = memstats_region_depth++;
+    if (depth >= memstats_region_max_depth)
+        return;
+    bool inserted = false;
+    const std::uint32_t id = memstats_intern_region(depth ? memstats_region_stack[depth - 1] : 0, name ? name : "",
+                                                    inserted);
+    memstats_region_stack[depth] = static_cast<std::uint16_t>(id);
+#if MEMSTAT_HAVE_TRACE
+    if (inserted and memstats_trace)
+        memstats_trace->write_region(*memstats_region(id));
+#endif
 }
 
-// instrumentation of new
-void *operator new(std::size_t sz) {
+void memstats_region_end() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    if (memstats_region_depth)
+        --memstats_region_depth;
+}
+
+void memstats_budget_begin(std::size_t max_count, std::size_t max_bytes) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_thread_budget = MemStatsThreadBudget{true, false, max_count, max_bytes, 0, 0};
+}
+
+bool memstats_budget_end() {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_thread_budget.active = false;
+    return !memstats_thread_budget.exceeded;
+}
+
+void memstats_set_budget_handler(memstats_budget_handler handler) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_budget_callback.store(handler, std::memory_order_release);
+}
+
+bool memstats_do_instrument() {
 #if MEMSTATS_USE_MEMORY_TRACER
     const MemoryTracerGuard guard;
 #endif
 
-    // prevent multiple thread from allocating memory at the same time s.t. events are in order
-    //std::lock_guard<std::mutex> lock(memstats_events_mutex);
+    // check the global flag first: the C allocator hooks may run before thread-locals can be initialized
+    return memstats_instrumentation_global.load(std::memory_order_acquire) and memstats_instrumentation_thread and
+           !memstats_reentrant;
+}
+
+/** Records an allocation if instrumented and, when sampling, if it is sampled.
+ * 'caller' is the return address of the allocation function, i.e. the call site in the program.
+ */
+void memstats_record_allocation(void *ptr, std::size_t sz, std::size_t alignment, unsigned char form,
+                                const void *caller) {
+    if (memstats_thread_budget.active and !memstats_reentrant)
+        memstats_budget_charge(sz, caller);
+    if (memstats_do_instrument() and memstats_sample(sz))
+        MemStatsInfo::record(ptr, sz, alignment, form, caller);
+}
+
+// frees of sampled allocations cannot be told apart from the others, so frees are not recorded when sampling
+void memstats_record_free(void *ptr, std::size_t alignment, unsigned char form, const void *caller) {
+    if (memstats_do_instrument() and !memstats_sample_rate)
+        MemStatsInfo::record(ptr, 0, alignment, form, caller);
+}
+
+void *memstats_allocate(std::size_t sz, std::size_t alignment, unsigned char form, const void *caller) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
 
     if (sz == 0)
         sz = 1;
     void *ptr;
-    while ((ptr = std::malloc(sz)) == nullptr) {
+    while ((ptr = alignment ? memstats_aligned_malloc(alignment, sz) : memstats_raw_malloc(sz)) == nullptr) {
         std::new_handler handler = std::get_new_handler();
         if (handler)
             handler();
         else
             throw std::bad_alloc{};
     }
-    if (memstats_do_instrument())
-        MemStatsInfo::record(ptr, sz);
+    memstats_record_allocation(ptr, sz, alignment, form, caller);
 
     return ptr;
 }
 
-// instrumentation of new
-void *operator new(std::size_t sz, std::nothrow_t) noexcept {
+void *memstats_allocate_nothrow(std::size_t sz, std::size_t alignment, unsigned char form,
+                                const void *caller) noexcept {
 #if MEMSTATS_USE_MEMORY_TRACER
     const MemoryTracerGuard guard;
 #endif
 
     try {
-        return ::operator new(sz);
+        return memstats_allocate(sz, alignment, form, caller);
     } catch (...) {
     }
     return nullptr;
 }
 
+void memstats_deallocate(void *ptr, std::size_t alignment, unsigned char form, const void *caller) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_record_free(ptr, alignment, form, caller);
+    if (alignment)
+        memstats_aligned_free(ptr);
+    else
+        memstats_raw_free(ptr);
+}
+
+// instrumentation of new
+void *operator new(std::size_t sz) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    return memstats_allocate(sz, 0, 0, MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of new
+void *operator new[](std::size_t sz) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    return memstats_allocate(sz, 0, memstats_form_array, MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of new
+void *operator new(std::size_t sz, const std::nothrow_t &) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    return memstats_allocate_nothrow(sz, 0, memstats_form_nothrow, MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of new
+void *operator new[](std::size_t sz, const std::nothrow_t &) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    return memstats_allocate_nothrow(sz, 0, memstats_form_array | memstats_form_nothrow, MEMSTATS_RETURN_ADDRESS());
+}
+
 // instrumentation of delete
 void operator delete(void *ptr) noexcept {
 #if MEMSTATS_USE_MEMORY_TRACER
     const MemoryTracerGuard guard;
 #endif
 
-    // prevent multiple thread from deallocating memory at the same time s.t. events are in order
-    //std::lock_guard<std::mutex> lock(memstats_events_mutex);
+    memstats_deallocate(ptr, 0, 0, MEMSTATS_RETURN_ADDRESS());
+}
 
-    if (memstats_do_instrument())
-        MemStatsInfo::record(ptr);
-    std::free(ptr);
+// instrumentation of delete
+void operator delete[](void *ptr) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, 0, memstats_form_array, MEMSTATS_RETURN_ADDRESS());
 }
 
 // instrumentation of delete
-void operator delete(void *ptr, std::nothrow_t) noexcept {
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
 #if MEMSTATS_USE_MEMORY_TRACER
     const MemoryTracerGuard guard;
 #endif
 
-    try {
-        return ::operator delete(ptr);
-    } catch (...) {
+    memstats_deallocate(ptr, 0, memstats_form_nothrow, MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of delete
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, 0, memstats_form_array | memstats_form_nothrow, MEMSTATS_RETURN_ADDRESS());
+}
+
+#if __cplusplus >= 201402L or __cpp_sized_deallocation >= 201309L
+
+// instrumentation of sized delete
+void operator delete(void *ptr, std::size_t) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, 0, memstats_form_sized, MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of sized delete
+void operator delete[](void *ptr, std::size_t) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, 0, memstats_form_array | memstats_form_sized, MEMSTATS_RETURN_ADDRESS());
+}
+
+#endif
+
+#if __cpp_aligned_new >= 201606L
+
+// instrumentation of aligned new
+void *operator new(std::size_t sz, std::align_val_t al) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    return memstats_allocate(sz, static_cast<std::size_t>(al), memstats_form_aligned, MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned new
+void *operator new[](std::size_t sz, std::align_val_t al) {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    return memstats_allocate(sz, static_cast<std::size_t>(al), memstats_form_array | memstats_form_aligned,
+                             MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned new
+void *operator new(std::size_t sz, std::align_val_t al, const std::nothrow_t &) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    return memstats_allocate_nothrow(sz, static_cast<std::size_t>(al), memstats_form_aligned | memstats_form_nothrow,
+                                     MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned new
+void *operator new[](std::size_t sz, std::align_val_t al, const std::nothrow_t &) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    return memstats_allocate_nothrow(sz, static_cast<std::size_t>(al), memstats_form_array | memstats_form_aligned | memstats_form_nothrow,
+                                     MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned delete
+void operator delete(void *ptr, std::align_val_t al) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, static_cast<std::size_t>(al), memstats_form_aligned, MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned delete
+void operator delete[](void *ptr, std::align_val_t al) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, static_cast<std::size_t>(al), memstats_form_array | memstats_form_aligned,
+                        MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned delete
+void operator delete(void *ptr, std::size_t, std::align_val_t al) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, static_cast<std::size_t>(al), memstats_form_sized | memstats_form_aligned,
+                        MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned delete
+void operator delete[](void *ptr, std::size_t, std::align_val_t al) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, static_cast<std::size_t>(al), memstats_form_array | memstats_form_sized | memstats_form_aligned,
+                        MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned delete
+void operator delete(void *ptr, std::align_val_t al, const std::nothrow_t &) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, static_cast<std::size_t>(al), memstats_form_aligned | memstats_form_nothrow,
+                        MEMSTATS_RETURN_ADDRESS());
+}
+
+// instrumentation of aligned delete
+void operator delete[](void *ptr, std::align_val_t al, const std::nothrow_t &) noexcept {
+#if MEMSTATS_USE_MEMORY_TRACER
+    const MemoryTracerGuard guard;
+#endif
+
+    memstats_deallocate(ptr, static_cast<std::size_t>(al), memstats_form_array | memstats_form_aligned | memstats_form_nothrow,
+                        MEMSTATS_RETURN_ADDRESS());
+}
+
+#endif
+
+#if MEMSTATS_PRELOAD
+
+/** Interposition of the C allocator for the 'memstats_preload' library, used with LD_PRELOAD.
+ * Calls are forwarded to glibc and recorded like the ones of 'new' and 'delete'. Allocations of memstats itself
+ * go to glibc directly, and anything allocated while recording is excluded by 'MemStatsReentrancyGuard'.
+ */
+#define MEMSTATS_PRELOAD_EXPORT extern "C" __attribute__((visibility("default")))
+
+MEMSTATS_PRELOAD_EXPORT void *malloc(std::size_t size) {
+    void *ptr = __libc_malloc(size);
+    if (ptr)
+        memstats_record_allocation(ptr, size ? size : 1, 0, memstats_form_malloc, MEMSTATS_RETURN_ADDRESS());
+    return ptr;
+}
+
+MEMSTATS_PRELOAD_EXPORT void *calloc(std::size_t count, std::size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    const std::size_t bytes = count * size;
+    if (ptr)
+        memstats_record_allocation(ptr, bytes ? bytes : 1, 0, memstats_form_malloc, MEMSTATS_RETURN_ADDRESS());
+    return ptr;
+}
+
+void *memstats_realloc(void *ptr, std::size_t size, const void *caller) {
+    if (!memstats_do_instrument())
+        return __libc_realloc(ptr, size);
+
+    // record the release before the address may be handed out to another thread
+    const std::size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    if (ptr)
+        memstats_record_free(ptr, 0, memstats_form_malloc, caller);
+    void *ret = __libc_realloc(ptr, size);
+    if (ret)
+        memstats_record_allocation(ret, size ? size : 1, 0, memstats_form_malloc, caller);
+    else if (ptr and size)
+        memstats_record_allocation(ptr, old_size, 0, memstats_form_malloc, caller); // failed, the old block is still alive
+    return ret;
+}
+
+MEMSTATS_PRELOAD_EXPORT void *realloc(void *ptr, std::size_t size) {
+    return memstats_realloc(ptr, size, MEMSTATS_RETURN_ADDRESS());
+}
+
+MEMSTATS_PRELOAD_EXPORT void *reallocarray(void *ptr, std::size_t count, std::size_t size) {
+    std::size_t bytes = 0;
+    if (__builtin_mul_overflow(count, size, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return memstats_realloc(ptr, bytes, MEMSTATS_RETURN_ADDRESS());
+}
+
+MEMSTATS_PRELOAD_EXPORT void free(void *ptr) {
+    if (ptr)
+        memstats_record_free(ptr, 0, memstats_form_malloc, MEMSTATS_RETURN_ADDRESS());
+    __libc_free(ptr);
+}
+
+void *memstats_memalign(std::size_t alignment, std::size_t size, const void *caller) {
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr)
+        memstats_record_allocation(ptr, size ? size : 1, alignment, memstats_form_malloc, caller);
+    return ptr;
+}
+
+MEMSTATS_PRELOAD_EXPORT void *memalign(std::size_t alignment, std::size_t size) {
+    return memstats_memalign(alignment, size, MEMSTATS_RETURN_ADDRESS());
+}
+
+MEMSTATS_PRELOAD_EXPORT void *aligned_alloc(std::size_t alignment, std::size_t size) {
+    return memstats_memalign(alignment, size, MEMSTATS_RETURN_ADDRESS());
+}
+
+MEMSTATS_PRELOAD_EXPORT void *valloc(std::size_t size) {
+    void *ptr = __libc_valloc(size);
+    if (ptr)
+        memstats_record_allocation(ptr, size ? size : 1, static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)),
+                                   memstats_form_malloc, MEMSTATS_RETURN_ADDRESS());
+    return ptr;
+}
+
+// the size is rounded up to whole pages, at least one
+MEMSTATS_PRELOAD_EXPORT void *pvalloc(std::size_t size) {
+    void *ptr = __libc_pvalloc(size);
+    const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    if (ptr)
+        memstats_record_allocation(ptr, size ? (size + page - 1) / page * page : page, page, memstats_form_malloc,
+                                   MEMSTATS_RETURN_ADDRESS());
+    return ptr;
+}
+
+MEMSTATS_PRELOAD_EXPORT int posix_memalign(void **memptr, std::size_t alignment, std::size_t size) {
+    if (alignment % sizeof(void *) != 0 or (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *ptr = memstats_memalign(alignment, size, MEMSTATS_RETURN_ADDRESS());
+    if (!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+template<class F>
+F memstats_next_symbol(std::atomic<F> &symbol, const char *name) {
+    F function = symbol.load(std::memory_order_acquire);
+    if (!function) {
+        function = reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+        symbol.store(function, std::memory_order_release);
+    }
+    return function;
+}
+
+using memstats_mmap_t = void *(*)(void *, std::size_t, int, int, int, off_t);
+using memstats_munmap_t = int (*)(void *, std::size_t);
+MEMSTATS_CONSTINIT static std::atomic<memstats_mmap_t> memstats_next_mmap{nullptr};
+MEMSTATS_CONSTINIT static std::atomic<memstats_munmap_t> memstats_next_munmap{nullptr};
+
+/** Start addresses and lengths of the anonymous mappings recorded as allocations, so that 'munmap' only records
+ * the release of those, and not of file mappings. A lock-free open-addressing set without allocations: a released
+ * address leaves a tombstone that the next insertion reuses, and a mapping that finds no slot within a few probes
+ * is not recorded at all. The length of a slot is only read by the 'munmap' of its address, which follows the
+ * 'mmap' that stored it.
+ */
+constexpr std::size_t memstats_mapping_capacity = std::size_t(1) << 14;
+constexpr std::size_t memstats_mapping_probes = 64;
+constexpr std::uintptr_t memstats_mapping_released = 1;
+static std::atomic<std::uintptr_t> memstats_mappings[memstats_mapping_capacity];
+static std::atomic<std::size_t> memstats_mapping_lengths[memstats_mapping_capacity];
+
+std::size_t memstats_mapping_slot(std::uintptr_t address) {
+    return static_cast<std::size_t>((address >> 12) * 0x9E3779B97F4A7C15ull >> 50) & (memstats_mapping_capacity - 1);
+}
+
+bool memstats_insert_mapping(std::uintptr_t address, std::size_t length) {
+    for (std::size_t i = memstats_mapping_slot(address), probes = 0; probes != memstats_mapping_probes;
+         i = (i + 1) & (memstats_mapping_capacity - 1), ++probes) {
+        std::uintptr_t entry = memstats_mappings[i].load(std::memory_order_relaxed);
+        if ((entry == 0 or entry == memstats_mapping_released) and
+            memstats_mappings[i].compare_exchange_strong(entry, address, std::memory_order_relaxed)) {
+            memstats_mapping_lengths[i].store(length, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+// takes the mapping at 'address' out of the set, and sets its 'length'
+bool memstats_erase_mapping(std::uintptr_t address, std::size_t &length) {
+    for (std::size_t i = memstats_mapping_slot(address), probes = 0; probes != memstats_mapping_probes;
+         i = (i + 1) & (memstats_mapping_capacity - 1), ++probes) {
+        std::uintptr_t entry = memstats_mappings[i].load(std::memory_order_relaxed);
+        length = memstats_mapping_lengths[i].load(std::memory_order_relaxed);
+        if (entry == address and
+            memstats_mappings[i].compare_exchange_strong(entry, memstats_mapping_released, std::memory_order_relaxed))
+            return true;
+        if (entry == 0)
+            return false;
+    }
+    return false;
+}
+
+// only anonymous mappings are allocations, file mappings are not recorded
+MEMSTATS_PRELOAD_EXPORT void *mmap(void *addr, std::size_t length, int prot, int flags, int fd, off_t offset) {
+    void *ptr = memstats_next_symbol(memstats_next_mmap, "mmap")(addr, length, prot, flags, fd, offset);
+    if (ptr != MAP_FAILED and (flags & MAP_ANONYMOUS) and memstats_do_instrument() and
+        memstats_insert_mapping(reinterpret_cast<std::uintptr_t>(ptr), length))
+        memstats_record_allocation(ptr, length, 0, memstats_form_mmap, MEMSTATS_RETURN_ADDRESS());
+    return ptr;
+}
+
+/** Records the release of the mappings that start at 'addr' and follow each other within the unmapped pages, once
+ * the pages are unmapped. The pages of the last one past the unmapped range stay mapped, and are recorded as a
+ * mapping of their own. Unmapping pages that do not start a recorded mapping records nothing.
+ */
+MEMSTATS_PRELOAD_EXPORT int munmap(void *addr, std::size_t length) {
+    const void *caller = MEMSTATS_RETURN_ADDRESS();
+    const std::uintptr_t page = static_cast<std::uintptr_t>(::sysconf(_SC_PAGESIZE));
+    auto round_to_pages = [page](std::uintptr_t size) { return (size + page - 1) / page * page; };
+    const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(addr), end = begin + round_to_pages(length);
+
+    // taken out before the pages are released, so that a mapping that another thread then gets at the same address
+    // is not mistaken for them, and put back if 'munmap' fails
+    constexpr std::size_t max_released = 16;
+    std::pair<std::uintptr_t, std::size_t> released[max_released];
+    std::size_t count = 0;
+    for (std::uintptr_t next = begin; next < end and count != max_released;) {
+        std::size_t mapped = 0;
+        if (!memstats_erase_mapping(next, mapped))
+            break;
+        released[count++] = std::make_pair(next, mapped);
+        next += round_to_pages(mapped);
+    }
+
+    const int result = memstats_next_symbol(memstats_next_munmap, "munmap")(addr, length);
+    for (std::size_t i = 0; i != count; ++i) {
+        const std::uintptr_t start = released[i].first, mapped_end = start + round_to_pages(released[i].second);
+        if (result != 0) {
+            memstats_insert_mapping(start, released[i].second);
+            continue;
+        }
+        memstats_record_free(reinterpret_cast<void *>(start), 0, memstats_form_mmap, caller);
+        if (mapped_end > end and memstats_do_instrument() and memstats_insert_mapping(end, mapped_end - end))
+            memstats_record_allocation(reinterpret_cast<void *>(end), mapped_end - end, 0, memstats_form_mmap, caller);
     }
+    return result;
 }
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef MEMSTATS_HH
 #define MEMSTATS_HH
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,6 +16,15 @@ extern "C" {
  */
 void memstats_report(const char * report_name = "");
 
+/** @brief Reports on instrumented statistics while other threads keep calling 'new' and 'delete'.
+ * @details Thread-safe. Collects what every thread recorded since the last snapshot, without
+ * waiting for them, and reports either the statistics accumulated since the last 'memstats_report'
+ * or, with 'delta', only the ones collected by this call. Nothing is flushed: the next
+ * 'memstats_report' still covers the events of the snapshots before it.
+ * Do not call during static- or dynamic-initialization phase.
+ */
+void memstats_snapshot(const char * snapshot_name = "", bool delta = false);
+
 /** @brief Enable instrumentation of 'new' and 'delete' for the calling thread.
  * @details Thread-local. Do not call during static- or dynamic-initialization phase.
  * @return Whether instrumentation was enabled before to this call
@@ -26,8 +37,80 @@ bool memstats_enable_thread_instrumentation();
  */
 bool memstats_disable_thread_instrumentation();
 
+/** @brief Enter the region 'name' on the calling thread, e.g. "request parse".
+ * @details Thread-local. Events of the thread are accounted to the innermost region
+ * until 'memstats_region_end', and are reported per region, across threads.
+ * Regions nest: the same name inside different regions is reported separately.
+ */
+void memstats_region_begin(const char * name);
+
+/** @brief Leave the innermost region entered on the calling thread.
+ * @details Thread-local. Does nothing if no region was entered.
+ */
+void memstats_region_end();
+
+/** @brief Start an allocation budget on the calling thread: at most 'max_count' allocations
+ * and 'max_bytes' bytes until 'memstats_budget_end', '(size_t)-1' for no limit.
+ * @details Thread-local. Every allocation of the thread is counted against the budget, also
+ * when instrumentation is disabled. The first allocation over budget triggers the action of
+ * 'MEMSTATS_BUDGET_ACTION', or the handler of 'memstats_set_budget_handler'.
+ * Budgets do not nest: a new budget replaces the one of the thread.
+ */
+void memstats_budget_begin(size_t max_count, size_t max_bytes);
+
+/** @brief End the allocation budget of the calling thread.
+ * @details Thread-local.
+ * @return Whether the allocations since 'memstats_budget_begin' stayed within the budget
+ */
+bool memstats_budget_end();
+
+/** @brief Called with the number of allocations and of bytes allocated since 'memstats_budget_begin'
+ * when a budget is exceeded, on the thread of the budget. Its own allocations are not counted.
+ */
+typedef void (*memstats_budget_handler)(size_t count, size_t bytes);
+
+/** @brief Set the handler called when a budget is exceeded instead of 'MEMSTATS_BUDGET_ACTION', or
+ * 'NULL' to go back to it.
+ * @details Thread-safe.
+ */
+void memstats_set_budget_handler(memstats_budget_handler handler);
+
 #ifdef __cplusplus
 }
+
+/** @brief Region of the calling thread for the lifetime of the object.
+ * @details Enters the region 'name' on construction and leaves it on destruction.
+ */
+class MemStatsRegion {
+public:
+    explicit MemStatsRegion(const char * name) {
+        memstats_region_begin(name);
+    }
+
+    ~MemStatsRegion() {
+        memstats_region_end();
+    }
+
+    MemStatsRegion(const MemStatsRegion &) = delete;
+    MemStatsRegion &operator=(const MemStatsRegion &) = delete;
+};
+
+/** @brief Allocation budget of the calling thread for the lifetime of the object.
+ * @details Starts the budget on construction and ends it on destruction.
+ */
+class MemStatsBudget {
+public:
+    explicit MemStatsBudget(size_t max_count, size_t max_bytes = static_cast<size_t>(-1)) {
+        memstats_budget_begin(max_count, max_bytes);
+    }
+
+    ~MemStatsBudget() {
+        memstats_budget_end();
+    }
+
+    MemStatsBudget(const MemStatsBudget &) = delete;
+    MemStatsBudget &operator=(const MemStatsBudget &) = delete;
+};
 #endif
 
 #endif // MEMSTATS_HH
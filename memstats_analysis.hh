@@ -0,0 +1,392 @@
+#ifndef MEMSTATS_ANALYSIS_HH
+#define MEMSTATS_ANALYSIS_HH
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "memstats_format.hh"
+
+/** Analyses of the history of each pointer shared by 'memstats_report' and the offline 'memstats-analyze', so both
+ * find the same live bytes, lifetimes and memory errors. Each analysis is fed the events of all threads in time
+ * order, one at a time, and keeps one entry per distinct pointer.
+ * 'Thread' identifies the thread of an event. Containers allocate with 'Allocator', so that the library can
+ * allocate them from 'malloc' without recording them.
+ */
+
+// flags describing the form of the replaceable 'new'/'delete' operator
+enum MemStatsForm : unsigned char {
+    memstats_form_array = 1,
+    memstats_form_nothrow = 2,
+    memstats_form_sized = 4,
+    memstats_form_aligned = 8,
+    memstats_form_malloc = 16, // C allocator: 'malloc', 'calloc', 'realloc', 'posix_memalign', ...
+    memstats_form_mmap = 32,   // anonymous 'mmap' and 'munmap'
+};
+
+// name of the function that produced an event of 'form'
+inline const char *memstats_form_name(bool allocation, unsigned char form) {
+    if (form & memstats_form_malloc)
+        return allocation ? "malloc" : "free";
+    if (form & memstats_form_mmap)
+        return allocation ? "mmap" : "munmap";
+    // by allocation, alignment and array form
+    static const char *const names[2][2][2] = {{{"delete", "delete[]"}, {"aligned delete", "aligned delete[]"}},
+                                               {{"new", "new[]"}, {"aligned new", "aligned new[]"}}};
+    return names[allocation][(form & memstats_form_aligned) != 0][(form & memstats_form_array) != 0];
+}
+
+// address 'ptr' of an event, for printing
+inline const void *memstats_pointer(std::uint64_t ptr) {
+    return reinterpret_cast<const void *>(static_cast<std::uintptr_t>(ptr));
+}
+
+// an allocation of 'size' bytes at 'ptr', or its free if 'size' is 0
+template<class Thread>
+struct MemStatsEvent {
+    std::uint64_t ptr;
+    std::uint64_t size;
+    std::uint64_t time;   // ticks of the clock of the events
+    Thread thread;
+    std::uint32_t stack;  // id of the interned stack, 0 if none
+    unsigned char form;   // 'MemStatsForm' flags of the operator that produced the event
+};
+
+template<class Key, class T, template<class> class Allocator>
+using MemStatsAnalysisMap = std::unordered_map<Key, T, std::hash<Key>, std::equal_to<Key>,
+                                               Allocator<std::pair<const Key, T> > >;
+
+/** Open-addressing hash table with linear probing, keyed by non-null pointers.
+ * Entries are never removed, so it holds one entry per distinct pointer seen.
+ */
+template<class T, template<class> class Allocator>
+class MemStatsPointerTable {
+    struct Slot {
+        std::uint64_t ptr;
+        T value;
+    };
+
+public:
+    MemStatsPointerTable() : slots(16, Slot{0, T{}}) {
+    }
+
+    // finds the entry for 'ptr' or inserts a value-initialized one
+    T &operator[](std::uint64_t ptr) {
+        assert(ptr);
+        if (2 * (used + 1) > slots.size())
+            rehash(2 * slots.size());
+        Slot &slot = find(slots, ptr);
+        if (!slot.ptr) {
+            slot.ptr = ptr;
+            ++used;
+        }
+        return slot.value;
+    }
+
+    // calls 'f(ptr, value)' for each entry
+    template<class F>
+    void for_each(F &&f) const {
+        for (const Slot &slot: slots)
+            if (slot.ptr)
+                f(slot.ptr, slot.value);
+    }
+
+private:
+    using Slots = std::vector<Slot, Allocator<Slot> >;
+
+    static Slot &find(Slots &slots, std::uint64_t ptr) {
+        // allocations are aligned, so mix the address before taking the lower bits
+        std::uint64_t hash = ptr * 0x9E3779B97F4A7C15ull;
+        const std::size_t mask = slots.size() - 1;
+        for (std::size_t i = (hash ^ (hash >> 32)) & mask;; i = (i + 1) & mask)
+            if (slots[i].ptr == ptr or !slots[i].ptr)
+                return slots[i];
+    }
+
+    void rehash(std::size_t capacity) {
+        Slots old(capacity, Slot{0, T{}});
+        old.swap(slots);
+        for (Slot &slot: old)
+            if (slot.ptr)
+                find(slots, slot.ptr) = std::move(slot);
+    }
+
+    Slots slots;
+    std::size_t used = 0;
+};
+
+/** Matches frees to allocations regardless of the freeing thread: allocations never freed, pointers freed more
+ * than once, and pairs of allocation and free done with incompatible forms of 'new' and 'delete'.
+ */
+template<class Thread, template<class> class Allocator>
+class MemStatsMemoryErrors {
+public:
+    using Event = MemStatsEvent<Thread>;
+
+    struct Mismatch {
+        Event allocation;
+        unsigned char free_form;
+    };
+
+    void add(const Event &event) {
+        if (!event.ptr)
+            return;
+        Pointer &pointer = pointers[event.ptr];
+        if (event.size > 0) {
+            // the address is handed out again: frees of the previous allocation are complete
+            if (pointer.times_freed > 1)
+                double_frees.emplace_back(event.ptr, pointer.times_freed);
+            pointer.sequence = sequence++;
+            pointer.allocation = event;
+            pointer.allocated = true;
+            pointer.times_freed = 0;
+        } else if (pointer.times_freed++ == 0 and pointer.allocated and
+                   ((pointer.allocation.form ^ event.form) & matching_forms)) {
+            mismatches.push_back(Mismatch{pointer.allocation, event.form});
+        }
+    }
+
+    // collects the leaks, in order of allocation, and the pointers freed more than once since their last allocation
+    void finish() {
+        std::vector<std::pair<std::uint64_t, Event>, Allocator<std::pair<std::uint64_t, Event> > > leaked;
+        pointers.for_each([&](std::uint64_t ptr, const Pointer &pointer) {
+            if (pointer.allocated and pointer.times_freed == 0)
+                leaked.emplace_back(pointer.sequence, pointer.allocation);
+            if (pointer.times_freed > 1)
+                double_frees.emplace_back(ptr, pointer.times_freed);
+        });
+        std::sort(leaked.begin(), leaked.end(),
+                  [](const std::pair<std::uint64_t, Event> &a, const std::pair<std::uint64_t, Event> &b) {
+                      return a.first < b.first;
+                  });
+        for (const auto &leak: leaked)
+            leaks.push_back(leak.second);
+    }
+
+    std::vector<Event, Allocator<Event> > leaks;
+    std::vector<std::pair<std::uint64_t, std::size_t>, Allocator<std::pair<std::uint64_t, std::size_t> > > double_frees;
+    std::vector<Mismatch, Allocator<Mismatch> > mismatches;
+
+private:
+    static constexpr unsigned char matching_forms =
+            memstats_form_array | memstats_form_aligned | memstats_form_malloc | memstats_form_mmap;
+
+    struct Pointer {
+        std::uint64_t sequence; // order of the last allocation in time
+        Event allocation;
+        bool allocated;
+        std::size_t times_freed; // frees since the last allocation
+    };
+
+    MemStatsPointerTable<Pointer, Allocator> pointers;
+    std::uint64_t sequence = 0;
+};
+
+// bytes allocated and not freed yet, over time
+template<template<class> class Allocator>
+struct MemStatsLive {
+    std::uint64_t current = 0, peak = 0;
+    std::size_t column = 0; // interval of time of the last change
+    std::vector<double, Allocator<double> > timeline; // maximum of live bytes per interval of time
+
+    void update(std::size_t bins, std::size_t to_column, std::uint64_t add, std::uint64_t sub) {
+        if (timeline.empty())
+            timeline.resize(bins, 0.);
+        // intervals without changes keep the bytes live before
+        for (; column < to_column; ++column)
+            timeline[column + 1] = std::max(timeline[column + 1], double(current));
+        current = current + add - sub;
+        peak = std::max(peak, current);
+        timeline[to_column] = std::max(timeline[to_column], double(current));
+    }
+};
+
+/** Follows the live bytes in total and per thread over 'bins' intervals of time between the events at 'begin'
+ * and 'end'. Bytes count for the thread that allocated them, whichever thread frees them.
+ */
+template<class Thread, template<class> class Allocator>
+class MemStatsLiveMemory {
+public:
+    using Event = MemStatsEvent<Thread>;
+    using Live = MemStatsLive<Allocator>;
+
+    MemStatsLiveMemory(std::size_t bins, std::uint64_t begin, std::uint64_t end)
+        : bins(bins), begin(begin), span(end >= begin ? end - begin + 1 : 1) {
+    }
+
+    void add(const Event &event) {
+        ++events;
+        if (!event.ptr)
+            return;
+        Allocation &allocation = pointers[event.ptr];
+        const std::size_t column = std::min(
+            static_cast<std::size_t>(double(event.time - begin) * double(bins) / double(span)), bins - 1);
+        // a pointer allocated again without a free in between is taken as freed
+        const std::uint64_t freed = allocation.size;
+        if (freed)
+            threads[allocation.thread].update(bins, column, 0, freed);
+        if (event.size)
+            threads[event.thread].update(bins, column, event.size, 0);
+        const std::uint64_t peak = global.peak;
+        global.update(bins, column, event.size, freed);
+        if (global.peak > peak)
+            peak_events = events;
+        allocation = Allocation{event.size, event.thread};
+    }
+
+    // extends the timelines to the last interval
+    void finish() {
+        global.update(bins, bins - 1, 0, 0);
+        for (auto &entry: threads)
+            entry.second.update(bins, bins - 1, 0, 0);
+    }
+
+    Live global;
+    MemStatsAnalysisMap<Thread, Live, Allocator> threads;
+    std::uint64_t peak_events = 0; // number of events added when the peak was reached
+
+private:
+    struct Allocation {
+        std::uint64_t size; // 0 once freed
+        Thread thread;
+    };
+
+    std::size_t bins;
+    std::uint64_t begin, span;
+    std::uint64_t events = 0;
+    MemStatsPointerTable<Allocation, Allocator> pointers;
+};
+
+// bytes live per stack once the events added so far have happened, e.g. the ones up to the peak
+template<class Thread, template<class> class Allocator>
+class MemStatsLiveStacks {
+public:
+    void add(const MemStatsEvent<Thread> &event) {
+        if (event.ptr)
+            pointers[event.ptr] = Allocation{event.size, event.stack};
+    }
+
+    MemStatsAnalysisMap<std::uint32_t, std::uint64_t, Allocator> stacks() const {
+        MemStatsAnalysisMap<std::uint32_t, std::uint64_t, Allocator> stacks;
+        pointers.for_each([&](std::uint64_t, const Allocation &allocation) {
+            if (allocation.size and allocation.stack)
+                stacks[allocation.stack] += allocation.size;
+        });
+        return stacks;
+    }
+
+private:
+    struct Allocation {
+        std::uint64_t size;
+        std::uint32_t stack;
+    };
+
+    MemStatsPointerTable<Allocation, Allocator> pointers;
+};
+
+// allocations freed within this time are short-lived, candidates for stack buffers or arenas
+constexpr std::uint64_t memstats_short_lifetime = 10000;
+
+// time from allocation to free of the freed allocations
+template<template<class> class Allocator>
+struct MemStatsLifetimes {
+    double count = 0, short_lived = 0;
+    std::uint64_t max = 0;
+    MemStatsAnalysisMap<std::uint64_t, double, Allocator> lifetime_freq;
+
+    void add(std::uint64_t ns) {
+        count += 1;
+        short_lived += ns < memstats_short_lifetime;
+        const std::uint64_t bucket = memstats_lifetime_bucket(ns);
+        max = std::max(max, bucket);
+        lifetime_freq[bucket] += 1;
+    }
+
+    MemStatsLifetimes &operator+=(const MemStatsLifetimes &other) {
+        count += other.count;
+        short_lived += other.short_lived;
+        max = std::max(max, other.max);
+        for (const auto &frec: other.lifetime_freq)
+            lifetime_freq[frec.first] += frec.second;
+        return *this;
+    }
+};
+
+/** Pairs each free with its allocation and collects the time between them, in nanoseconds from the ticks of the
+ * events: in total, per allocating thread and per stack of the allocation.
+ */
+template<class Thread, template<class> class Allocator>
+class MemStatsLifetimeAnalysis {
+public:
+    using Lifetimes = MemStatsLifetimes<Allocator>;
+
+    explicit MemStatsLifetimeAnalysis(double ns_per_tick) : ns_per_tick(ns_per_tick) {
+    }
+
+    void add(const MemStatsEvent<Thread> &event) {
+        if (!event.ptr)
+            return;
+        Allocation &allocation = pointers[event.ptr];
+        if (event.size) {
+            allocation = Allocation{event.time, event.thread, event.stack, true};
+            return;
+        }
+        if (!allocation.live)
+            return;
+        allocation.live = false;
+        const std::uint64_t ns =
+                event.time > allocation.time ? std::uint64_t(double(event.time - allocation.time) * ns_per_tick) : 0;
+        total.add(ns);
+        threads[allocation.thread].add(ns);
+        if (allocation.stack)
+            stacks[allocation.stack].add(ns);
+    }
+
+    Lifetimes total;
+    MemStatsAnalysisMap<Thread, Lifetimes, Allocator> threads;
+    MemStatsAnalysisMap<std::uint32_t, Lifetimes, Allocator> stacks;
+
+private:
+    struct Allocation {
+        std::uint64_t time;
+        Thread thread;
+        std::uint32_t stack;
+        bool live;
+    };
+
+    double ns_per_tick;
+    MemStatsPointerTable<Allocation, Allocator> pointers;
+};
+
+/** Groups 'per_stack' (pairs of stack id and value) by allocation site, the innermost frame 'frame(stack)' of each
+ * stack, 0 if unknown. Each site keeps the id of one of its stacks, to name it, and the sum of their values.
+ */
+template<class Value, template<class> class Allocator, class PerStack, class Frame>
+MemStatsAnalysisMap<std::uint64_t, std::pair<std::uint32_t, Value>, Allocator>
+memstats_group_by_site(const PerStack &per_stack, Frame &&frame) {
+    MemStatsAnalysisMap<std::uint64_t, std::pair<std::uint32_t, Value>, Allocator> sites;
+    for (const auto &entry: per_stack)
+        if (const std::uint64_t address = frame(entry.first)) {
+            std::pair<std::uint32_t, Value> &site = sites[address];
+            site.first = entry.first;
+            site.second += entry.second;
+        }
+    return sites;
+}
+
+// sorts pairs of frame address and statistics of a stack entry in the order both reports print them: most bytes
+// first, then by address
+template<class Entries>
+void memstats_sort_stack_entries(Entries &entries) {
+    std::sort(entries.begin(), entries.end(), [](const typename Entries::value_type &a,
+                                                 const typename Entries::value_type &b) {
+        return a.second->size != b.second->size ? a.second->size > b.second->size : a.first < b.first;
+    });
+}
+
+#endif // MEMSTATS_ANALYSIS_HH
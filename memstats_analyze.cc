@@ -0,0 +1,558 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memstats_analysis.hh"
+#include "memstats_format.hh"
+#include "memstats_trace.hh"
+
+/** Offline analysis of a trace written with 'MEMSTATS_TRACE_FILE'.
+ * Prints the report that 'memstats_report' prints at exit of the traced process: histograms in total, per thread,
+ * region and stack entry, followed by leaks, double frees and mismatched new/delete pointers.
+ *
+ * The trace is mapped read-only and streamed twice, so it may be larger than the available memory:
+ * worker threads aggregate the statistics of disjoint chunks in parallel, while the main thread replays
+ * the events of all threads in time order to follow the lifetime of each pointer.
+ * Memory usage only grows with the number of distinct addresses, sizes and stacks.
+ */
+
+namespace {
+
+struct Stats {
+    double count{0}, size{0};
+    std::size_t max_size{0};
+    std::unordered_map<std::size_t, double> size_freq;
+
+    void add(const Stats &other) {
+        count += other.count;
+        size += other.size;
+        max_size = std::max(max_size, other.max_size);
+        for (const auto &frec: other.size_freq)
+            size_freq[frec.first] += frec.second;
+    }
+};
+
+class Trace {
+public:
+    ~Trace() {
+        if (base)
+            ::munmap(base, length);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    bool open(const char *path) {
+        struct stat status;
+        if ((fd = ::open(path, O_RDONLY | O_CLOEXEC)) < 0 or ::fstat(fd, &status) != 0)
+            return false;
+        length = static_cast<std::size_t>(status.st_size);
+        if (length < sizeof(MemStatsTraceHeader)) {
+            errno = EINVAL;
+            return false;
+        }
+        void *ptr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED)
+            return false;
+        base = static_cast<unsigned char *>(ptr);
+        ::madvise(base, length, MADV_SEQUENTIAL);
+        const MemStatsTraceHeader &header = this->header();
+        if (header.magic != memstats_trace_magic or header.version != memstats_trace_version or
+            header.chunk_size < sizeof(MemStatsTraceChunk) or header.header_size < sizeof(MemStatsTraceHeader)) {
+            errno = EINVAL;
+            return false;
+        }
+        return true;
+    }
+
+    const MemStatsTraceHeader &header() const {
+        return *reinterpret_cast<const MemStatsTraceHeader *>(base);
+    }
+
+    std::size_t chunks() const {
+        return (length - header().header_size) / header().chunk_size;
+    }
+
+    const MemStatsTraceChunk &chunk(std::size_t i) const {
+        return *reinterpret_cast<const MemStatsTraceChunk *>(base + header().header_size + i * header().chunk_size);
+    }
+
+    // published records of an event chunk, or published bytes of stack and symbol chunks
+    std::size_t used(const MemStatsTraceChunk &chunk) const {
+        const std::size_t capacity = header().chunk_size - sizeof(MemStatsTraceChunk);
+        const std::size_t used = chunk.used.load(std::memory_order_acquire);
+        return chunk.type == memstats_trace_events ? std::min(used, capacity / sizeof(MemStatsTraceEvent))
+                                                   : std::min(used, capacity);
+    }
+
+    static const MemStatsTraceEvent *events(const MemStatsTraceChunk &chunk) {
+        return reinterpret_cast<const MemStatsTraceEvent *>(&chunk + 1);
+    }
+
+    static const unsigned char *data(const MemStatsTraceChunk &chunk) {
+        return reinterpret_cast<const unsigned char *>(&chunk + 1);
+    }
+
+private:
+    int fd = -1;
+    unsigned char *base = nullptr;
+    std::size_t length = 0;
+};
+
+// inverse of the probability for an allocation of 'sz' bytes to be sampled, as in the traced process
+double sample_weight(std::size_t sz, std::uint64_t sample_rate) {
+    if (!sample_rate)
+        return 1.;
+    return -1. / std::expm1(-double(sz) / double(sample_rate));
+}
+
+// statistics of a range of event chunks, built by one worker
+struct Aggregate {
+    Stats global;
+    std::unordered_map<std::uint32_t, Stats> threads;
+    std::unordered_map<std::uint32_t, Stats> stacks;
+    std::unordered_map<std::uint32_t, Stats> regions;
+};
+
+void aggregate(const Trace &trace, const std::vector<std::size_t> &event_chunks, std::atomic<std::size_t> &next,
+               Aggregate &result) {
+    const std::uint64_t sample_rate = trace.header().sample_rate;
+    for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < event_chunks.size();) {
+        const MemStatsTraceChunk &chunk = trace.chunk(event_chunks[i]);
+        const MemStatsTraceEvent *events = Trace::events(chunk);
+        Stats &thread_stats = result.threads[chunk.thread];
+        for (std::size_t e = 0, used = trace.used(chunk); e != used; ++e) {
+            const MemStatsTraceEvent &event = events[e];
+            const std::size_t size = event.size;
+            const double weight = size ? sample_weight(size, sample_rate) : 0.;
+            auto register_stats = [&](Stats &stats) {
+                stats.count += weight;
+                stats.size += weight * double(size);
+                stats.max_size = std::max(stats.max_size, size);
+                if (size)
+                    stats.size_freq[size] += weight;
+            };
+            register_stats(result.global);
+            register_stats(thread_stats);
+            if (event.stack)
+                register_stats(result.stacks[event.stack]);
+            if (event.region)
+                register_stats(result.regions[event.region]);
+        }
+    }
+}
+
+struct Cursor {
+    std::uint64_t time;
+    std::uint32_t thread;
+    std::size_t chunk; // position in the chunks of the thread
+    std::size_t event;
+
+    bool operator>(const Cursor &other) const {
+        return time > other.time;
+    }
+};
+
+// events of the analyses shared with the library, identified by the index of their thread
+using Event = MemStatsEvent<std::uint32_t>;
+using Errors = MemStatsMemoryErrors<std::uint32_t, std::allocator>;
+using Lifetimes = MemStatsLifetimes<std::allocator>;
+
+Event event_of(const MemStatsTraceChunk &chunk, const MemStatsTraceEvent &event) {
+    return Event{event.ptr, event.size, chunk.base_time + event.time, chunk.thread, event.stack, event.form};
+}
+
+// calls 'f(event)' on the events of every thread in time order, until 'f' returns false
+template<class F>
+void for_each_in_time_order(const Trace &trace, const std::vector<std::vector<std::size_t> > &thread_chunks, F &&f) {
+    std::priority_queue<Cursor, std::vector<Cursor>, std::greater<Cursor> > queue;
+    auto push = [&](std::uint32_t thread, std::size_t chunk, std::size_t event) {
+        const std::vector<std::size_t> &chunks = thread_chunks[thread];
+        for (; chunk != chunks.size(); ++chunk, event = 0) {
+            const MemStatsTraceChunk &trace_chunk = trace.chunk(chunks[chunk]);
+            if (event < trace.used(trace_chunk)) {
+                queue.push(Cursor{trace_chunk.base_time + Trace::events(trace_chunk)[event].time, thread, chunk, event});
+                return;
+            }
+        }
+    };
+    for (std::uint32_t thread = 0; thread != thread_chunks.size(); ++thread)
+        push(thread, 0, 0);
+
+    while (!queue.empty()) {
+        const Cursor cursor = queue.top();
+        queue.pop();
+        const MemStatsTraceChunk &chunk = trace.chunk(thread_chunks[cursor.thread][cursor.chunk]);
+        push(cursor.thread, cursor.chunk, cursor.event + 1);
+        if (!f(event_of(chunk, Trace::events(chunk)[cursor.event])))
+            return;
+    }
+}
+
+// what replaying the events of every thread in time order finds, with the analyses of 'memstats_report'
+struct Replay {
+    Errors errors;
+    MemStatsLiveMemory<std::uint32_t, std::allocator> live;
+    MemStatsLifetimeAnalysis<std::uint32_t, std::allocator> lifetimes{1.}; // times of the trace are nanoseconds
+
+    Replay(std::size_t bins, std::uint64_t begin, std::uint64_t end) : live(bins, begin, end) {
+    }
+};
+
+Replay replay(const Trace &trace, const std::vector<std::vector<std::size_t> > &thread_chunks, std::size_t bins) {
+    // time span of the trace, for the timeline of live bytes
+    std::uint64_t begin = std::uint64_t(-1), end = 0;
+    for (const std::vector<std::size_t> &chunks: thread_chunks)
+        for (std::size_t i: chunks) {
+            const MemStatsTraceChunk &chunk = trace.chunk(i);
+            if (const std::size_t used = trace.used(chunk)) {
+                begin = std::min(begin, chunk.base_time + Trace::events(chunk)[0].time);
+                end = std::max(end, chunk.base_time + Trace::events(chunk)[used - 1].time);
+            }
+        }
+
+    Replay result(bins, begin, end);
+    for_each_in_time_order(trace, thread_chunks, [&](const Event &event) {
+        result.errors.add(event);
+        result.live.add(event);
+        result.lifetimes.add(event);
+        return true;
+    });
+    result.errors.finish();
+    result.live.finish();
+    return result;
+}
+
+// live bytes per stack when the first 'events' events in time order have been replayed
+std::unordered_map<std::uint32_t, std::uint64_t> live_stacks(const Trace &trace,
+                                                              const std::vector<std::vector<std::size_t> > &thread_chunks,
+                                                              std::uint64_t events) {
+    MemStatsLiveStacks<std::uint32_t, std::allocator> live;
+    for_each_in_time_order(trace, thread_chunks, [&](const Event &event) {
+        live.add(event);
+        return --events != 0;
+    });
+    return live.stacks();
+}
+
+template<class PrintStack>
+void print_memory_errors(const Errors &errors, const std::unordered_map<std::uint32_t, std::uint64_t> &thread_ids,
+                         PrintStack &&print_stack) {
+    std::cout << "\nMemory leaks:\n";
+    for (const Event &leak: errors.leaks) {
+        std::cout << "Pointer " << memstats_pointer(leak.ptr) << " was never freed in Thread "
+                << thread_ids.at(leak.thread) << "." << std::endl;
+        if (leak.stack) {
+            std::cout << "Current stacktrace:\n";
+            print_stack(leak.stack);
+        }
+    }
+
+    std::cout << "\nDouble freed pointers:\n";
+    for (const auto &entry: errors.double_frees)
+        std::cout << "Pointer " << memstats_pointer(entry.first) << " was freed " << entry.second << " times."
+                << std::endl;
+
+    std::cout << "\nMismatched new/delete pointers:\n";
+    for (const Errors::Mismatch &mismatch: errors.mismatches)
+        std::cout << "Pointer " << memstats_pointer(mismatch.allocation.ptr) << " was allocated with '"
+                << memstats_form_name(true, mismatch.allocation.form) << "' and freed with '"
+                << memstats_form_name(false, mismatch.free_form) << "'." << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    const char *path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-j") == 0 and i + 1 < argc)
+            jobs = std::max(1, std::atoi(argv[++i]));
+        else if (!path and argv[i][0] != '-')
+            path = argv[i];
+        else
+            path = nullptr, i = argc;
+    }
+    if (!path) {
+        std::cerr << "Usage: " << argv[0] << " [-j <threads>] <trace-file>\n"
+                << "Reports on a trace written by a program run with 'MEMSTATS_TRACE_FILE=<trace-file>'\n";
+        return 2;
+    }
+
+    Trace trace;
+    if (!trace.open(path)) {
+        std::cerr << "Trace '" << path << "' could not be read: " << std::strerror(errno) << '\n';
+        return 1;
+    }
+    const MemStatsTraceHeader &header = trace.header();
+    if (!header.clean_exit.load(std::memory_order_acquire))
+        std::cerr << "Trace '" << path << "' was not closed at exit, reporting the events written until then\n";
+
+    // headers of all chunks are small: index them first
+    std::vector<std::size_t> event_chunks;
+    std::vector<std::vector<std::size_t> > thread_chunks;
+    std::unordered_map<std::uint32_t, std::uint64_t> thread_ids;
+    std::unordered_map<std::uint32_t, std::vector<std::uint64_t> > stacks;
+    std::unordered_map<std::uint64_t, std::string> symbols;
+    std::unordered_map<std::uint32_t, std::pair<std::uint32_t, std::string> > regions; // parent and name of each id
+    for (std::size_t i = 0; i != trace.chunks(); ++i) {
+        const MemStatsTraceChunk &chunk = trace.chunk(i);
+        const std::size_t used = trace.used(chunk);
+        const unsigned char *data = Trace::data(chunk);
+        if (chunk.type == memstats_trace_events) {
+            event_chunks.push_back(i);
+            if (chunk.thread >= thread_chunks.size())
+                thread_chunks.resize(chunk.thread + 1);
+            thread_chunks[chunk.thread].push_back(i);
+            thread_ids.emplace(chunk.thread, chunk.thread_id);
+        } else if (chunk.type == memstats_trace_stacks) {
+            for (std::size_t offset = 0; offset + sizeof(MemStatsTraceStack) <= used;) {
+                MemStatsTraceStack stack;
+                std::memcpy(&stack, data + offset, sizeof(stack));
+                offset += sizeof(stack);
+                std::vector<std::uint64_t> &frames = stacks[stack.id];
+                frames.resize(std::min<std::size_t>(stack.depth, (used - offset) / sizeof(std::uint64_t)));
+                std::memcpy(frames.data(), data + offset, frames.size() * sizeof(std::uint64_t));
+                offset += std::size_t(stack.depth) * sizeof(std::uint64_t);
+            }
+        } else if (chunk.type == memstats_trace_symbols) {
+            for (std::size_t offset = 0; offset + sizeof(MemStatsTraceSymbol) <= used;) {
+                MemStatsTraceSymbol symbol;
+                std::memcpy(&symbol, data + offset, sizeof(symbol));
+                offset += sizeof(symbol);
+                const std::size_t length = std::min<std::size_t>(symbol.length, used - offset);
+                symbols[symbol.address].assign(reinterpret_cast<const char *>(data + offset), length);
+                offset += (std::size_t(symbol.length) + 7) / 8 * 8;
+            }
+        } else if (chunk.type == memstats_trace_regions) {
+            for (std::size_t offset = 0; offset + sizeof(MemStatsTraceRegion) <= used;) {
+                MemStatsTraceRegion region;
+                std::memcpy(&region, data + offset, sizeof(region));
+                offset += sizeof(region);
+                const std::size_t length = std::min<std::size_t>(region.length, used - offset);
+                regions[region.id] = std::make_pair(region.parent,
+                                                    std::string(reinterpret_cast<const char *>(data + offset), length));
+                offset += (std::size_t(region.length) + 7) / 8 * 8;
+            }
+        }
+    }
+
+    auto print_frame = [&](std::uint64_t address) {
+        auto it = symbols.find(address);
+        if (it != symbols.end())
+            std::cout << it->second;
+        else
+            std::cout << reinterpret_cast<const void *>(static_cast<std::uintptr_t>(address));
+    };
+    auto print_stack = [&](std::uint32_t id) {
+        const std::vector<std::uint64_t> &frames = stacks[id];
+        for (std::size_t i = 0; i != frames.size(); ++i) {
+            std::cout << std::right << std::setw(4) << i << "# ";
+            print_frame(frames[i]);
+            std::cout << '\n';
+        }
+    };
+
+    // aggregates are built in parallel while the events are replayed in time order on this thread
+    const unsigned workers = std::max(1u, jobs - 1);
+    std::vector<Aggregate> aggregates(workers);
+    std::atomic<std::size_t> next{0};
+    std::vector<std::thread> threads;
+    for (unsigned w = 0; w != workers; ++w)
+        threads.emplace_back(aggregate, std::cref(trace), std::cref(event_chunks), std::ref(next),
+                             std::ref(aggregates[w]));
+    // leaks and double frees need the history of each pointer, which is not kept when sampling
+    const bool replay_events = !header.sample_rate;
+    const std::size_t bins = memstats_bins();
+    Replay replayed(bins, 0, 0);
+    if (replay_events)
+        replayed = replay(trace, thread_chunks, bins);
+    for (std::thread &thread: threads)
+        thread.join();
+
+    Aggregate result;
+    for (Aggregate &partial: aggregates) {
+        result.global.add(partial.global);
+        for (const auto &entry: partial.threads)
+            result.threads[entry.first].add(entry.second);
+        for (const auto &entry: partial.stacks)
+            result.stacks[entry.first].add(entry.second);
+        for (const auto &entry: partial.regions)
+            result.regions[entry.first].add(entry.second);
+    }
+    if (result.global.count == 0 and event_chunks.empty())
+        return 0;
+
+    // each event counts for every entry of its stack, as in the report of the traced process
+    std::unordered_map<std::uint64_t, Stats> entry_stats;
+    for (const auto &entry: result.stacks)
+        for (std::uint64_t address: stacks[entry.first])
+            entry_stats[address].add(entry.second);
+
+    std::cout << "\n------------------- MemStats " << path << " -------------------\n";
+
+    const auto str_precentage = memstats_str_hist_representation();
+    std::vector<double> hist(bins);
+
+    if (header.sample_rate)
+        std::cout << "Estimated from allocations sampled every "
+                << memstats_bytes_to_string(double(header.sample_rate)) << " on average\n";
+
+    memstats_format_line(std::cout, hist, result.global.size_freq, result.global.max_size, result.global.size,
+                         result.global.count, str_precentage) << "Total\n";
+
+    for (std::uint32_t thread = 0; thread != thread_chunks.size(); ++thread) {
+        auto it = result.threads.find(thread);
+        if (it != result.threads.end() and it->second.size) {
+            memstats_format_line(std::cout, hist, it->second.size_freq, it->second.max_size, it->second.size,
+                                 it->second.count, str_precentage) << "Thread " << thread_ids[thread] << '\n';
+        }
+    }
+
+    // each event also counts for the regions around its own, sorted by path so that nested regions follow
+    auto parent = [&](std::uint32_t id) -> std::uint32_t {
+        auto it = regions.find(id);
+        // regions are interned after the region around them
+        return it != regions.end() and it->second.first < id ? it->second.first : 0;
+    };
+    auto region_path = [&](std::uint32_t id) -> std::string {
+        std::string path;
+        for (std::uint32_t outer = id; outer; outer = parent(outer)) {
+            auto it = regions.find(outer);
+            const std::string name = it != regions.end() ? it->second.second : "#" + std::to_string(outer);
+            path = path.empty() ? name : name + " > " + path;
+        }
+        return path;
+    };
+    std::map<std::string, Stats> region_stats;
+    for (const auto &entry: result.regions)
+        for (std::uint32_t id = entry.first; id; id = parent(id))
+            region_stats[region_path(id)].add(entry.second);
+    for (const auto &entry: region_stats)
+        if (entry.second.size) {
+            memstats_format_line(std::cout, hist, entry.second.size_freq, entry.second.max_size, entry.second.size,
+                                 entry.second.count, str_precentage) << "Region " << entry.first << '\n';
+        }
+
+    std::vector<std::pair<std::uint64_t, const Stats *> > entries;
+    for (const auto &entry: entry_stats)
+        if (entry.second.size)
+            entries.emplace_back(entry.first, &entry.second);
+    memstats_sort_stack_entries(entries);
+    for (const auto &entry: entries) {
+        memstats_format_line(std::cout, hist, entry.second->size_freq, entry.second->max_size, entry.second->size,
+                             entry.second->count, str_precentage);
+        print_frame(entry.first);
+        std::cout << '\n';
+    }
+
+    // sites are the innermost frames of the stacks
+    auto site = [&](std::uint32_t id) -> std::uint64_t {
+        auto it = stacks.find(id);
+        return it != stacks.end() and !it->second.empty() ? it->second[0] : 0;
+    };
+
+    const MemStatsLiveMemory<std::uint32_t, std::allocator> &live = replayed.live;
+    if (replay_events and live.global.peak) {
+        std::cout << "\nLive memory:\n";
+        memstats_format_sparkline(std::cout, live.global.timeline, double(live.global.peak), str_precentage);
+        std::cout << " | " << std::right << std::setw(6) << memstats_bytes_to_string(double(live.global.current))
+                << " at end | Total\n";
+        for (std::uint32_t thread = 0; thread != thread_chunks.size(); ++thread) {
+            auto it = live.threads.find(thread);
+            if (it != live.threads.end() and it->second.peak) {
+                memstats_format_sparkline(std::cout, it->second.timeline, double(it->second.peak), str_precentage);
+                std::cout << " | " << std::right << std::setw(6)
+                        << memstats_bytes_to_string(double(it->second.current)) << " at end | Thread "
+                        << thread_ids[thread] << '\n';
+            }
+        }
+
+        // what is live at the peak, grouped by the innermost frame of its stack
+        std::vector<std::pair<std::uint64_t, std::uint64_t> > top;
+        if (!stacks.empty())
+            for (const auto &entry: memstats_group_by_site<std::uint64_t, std::allocator>(
+                         live_stacks(trace, thread_chunks, live.peak_events), site))
+                top.emplace_back(entry.first, entry.second.second);
+        const std::size_t top_sites = std::min<std::size_t>(top.size(), 10);
+        std::partial_sort(top.begin(), top.begin() + top_sites, top.end(),
+                          [](const std::pair<std::uint64_t, std::uint64_t> &a,
+                             const std::pair<std::uint64_t, std::uint64_t> &b) { return a.second > b.second; });
+        if (top_sites)
+            std::cout << "\nTop allocation sites at peak:\n";
+        for (std::size_t i = 0; i != top_sites; ++i) {
+            std::cout << std::right << std::setw(6) << memstats_bytes_to_string(double(top[i].second)) << " ("
+                    << std::setw(3) << top[i].second * 100 / live.global.peak << "%) | ";
+            print_frame(top[i].first);
+            std::cout << '\n';
+        }
+    }
+
+    const MemStatsLifetimeAnalysis<std::uint32_t, std::allocator> &lifetimes = replayed.lifetimes;
+    if (replay_events and lifetimes.total.count) {
+        std::vector<std::pair<std::uint64_t, double> > sorted;
+        auto format_line = [&](const Lifetimes &lifetimes) -> std::ostream & {
+            const std::uint64_t median = memstats_lifetime_median(sorted, lifetimes.lifetime_freq, lifetimes.count);
+            return memstats_format_lifetime_line(std::cout, hist, lifetimes.lifetime_freq, lifetimes.max, median,
+                                                 lifetimes.count, str_precentage);
+        };
+        std::cout << "\nAllocation lifetimes:\n";
+        format_line(lifetimes.total) << "Total\n";
+        for (std::uint32_t thread = 0; thread != thread_chunks.size(); ++thread) {
+            auto it = lifetimes.threads.find(thread);
+            if (it != lifetimes.threads.end())
+                format_line(it->second) << "Thread " << thread_ids[thread] << '\n';
+        }
+
+        const auto site_lifetimes = memstats_group_by_site<Lifetimes, std::allocator>(lifetimes.stacks, site);
+        std::vector<std::pair<std::uint64_t, const Lifetimes *> > sites;
+        for (const auto &entry: site_lifetimes)
+            sites.emplace_back(entry.first, &entry.second.second);
+        std::sort(sites.begin(), sites.end(), [](const std::pair<std::uint64_t, const Lifetimes *> &a,
+                                                 const std::pair<std::uint64_t, const Lifetimes *> &b) {
+            return a.second->count > b.second->count;
+        });
+        for (const auto &site: sites) {
+            format_line(*site.second);
+            print_frame(site.first);
+            std::cout << '\n';
+        }
+
+        bool header = false;
+        for (const auto &site: sites)
+            if (2 * site.second->short_lived > site.second->count) {
+                if (!header)
+                    std::cout << "\nShort-lived allocation sites (most allocations freed within "
+                            << memstats_duration_to_string(double(memstats_short_lifetime)) << "):\n";
+                header = true;
+                std::cout << std::right << std::setw(3) << std::llround(100 * site.second->short_lived / site.second->count)
+                        << "% of " << std::left << std::setw(5) << memstats_int_to_string(site.second->count) << " | ";
+                print_frame(site.first);
+                std::cout << '\n';
+            }
+    }
+
+    if (replay_events)
+        print_memory_errors(replayed.errors, thread_ids, print_stack);
+
+    memstats_print_legend(std::cout);
+    return 0;
+}
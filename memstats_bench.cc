@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "memstats.hh"
+
+extern char **environ;
+
+/** Overhead of the instrumented 'operator new' and 'operator delete', in ns per pair of calls.
+ *
+ * Instrumentation is configured once per process by the environment, so each case runs in a child
+ * process of its own:
+ *   libc:       'malloc' and 'free', which the library does not replace, as the baseline
+ *   off:        'MEMSTATS_ENABLE_INSTRUMENTATION=false'
+ *   thread_off: global instrumentation on, but not for the measuring threads
+ *   recording:  every event is recorded
+ *   caller:     every event is recorded with its call site
+ *   stacks:     every event is recorded with its stack
+ * Each case sweeps allocation sizes and number of threads, from 1 to the number of cores.
+ * Results are printed as CSV on the standard output, with the difference to the baseline for the same size
+ * and number of threads; reports of the children are discarded.
+ */
+
+namespace {
+
+struct Case {
+    const char *name;
+    const char *environment[4];
+    bool libc; // measures 'malloc' and 'free' instead of 'operator new' and 'operator delete'
+};
+
+// the baseline comes first, so that the other cases are compared to it
+const Case cases[] = {
+    {"libc", {"MEMSTATS_ENABLE_INSTRUMENTATION=false", nullptr}, true},
+    {"off", {"MEMSTATS_ENABLE_INSTRUMENTATION=false", nullptr}, false},
+    {"thread_off", {"MEMSTATS_ENABLE_INSTRUMENTATION=true", "MEMSTATS_THREAD_INSTRUMENTATION_INIT=false", nullptr},
+     false},
+    {"recording", {"MEMSTATS_ENABLE_INSTRUMENTATION=true", "MEMSTATS_THREAD_INSTRUMENTATION_INIT=true",
+                   "MEMSTATS_STACKS=false", nullptr}, false},
+    {"caller", {"MEMSTATS_ENABLE_INSTRUMENTATION=true", "MEMSTATS_THREAD_INSTRUMENTATION_INIT=true",
+                "MEMSTATS_STACKS=caller", nullptr}, false},
+    {"stacks", {"MEMSTATS_ENABLE_INSTRUMENTATION=true", "MEMSTATS_THREAD_INSTRUMENTATION_INIT=true",
+                "MEMSTATS_STACKS=true", nullptr}, false},
+};
+
+const std::size_t sizes[] = {8, 64, 512, 4096, 32768};
+
+// keeps the compiler from optimizing the allocation away
+void escape(void *ptr) {
+#if defined(__GNUC__)
+    asm volatile("" : : "g"(ptr) : "memory");
+#else
+    static void *volatile sink;
+    sink = ptr;
+#endif
+}
+
+// ns per 'new'/'delete' pair, or 'malloc'/'free' pair for 'libc', on each of 'threads' threads doing 'ops' pairs
+// of 'size' bytes
+double measure(std::size_t size, unsigned threads, std::size_t ops, bool libc) {
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<double> ns(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t != threads; ++t)
+        workers.emplace_back([&, t] {
+            ready.fetch_add(1);
+            while (!go.load(std::memory_order_acquire)) {
+            }
+            const auto begin = std::chrono::steady_clock::now();
+            if (libc)
+                for (std::size_t i = 0; i != ops; ++i) {
+                    void *ptr = std::malloc(size);
+                    escape(ptr);
+                    std::free(ptr);
+                }
+            else
+                for (std::size_t i = 0; i != ops; ++i) {
+                    void *ptr = ::operator new(size);
+                    escape(ptr);
+                    ::operator delete(ptr);
+                }
+            const auto end = std::chrono::steady_clock::now();
+            ns[t] = double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count()) / double(ops);
+        });
+    while (ready.load() != threads) {
+    }
+    go.store(true, std::memory_order_release);
+    for (std::thread &worker: workers)
+        worker.join();
+    double total = 0;
+    for (double value: ns)
+        total += value;
+    return total / threads;
+}
+
+int run_case(const char *name, std::size_t ops, unsigned max_threads) {
+    const Case *test = std::find_if(std::begin(cases), std::end(cases),
+                                    [&](const Case &c) { return std::strcmp(c.name, name) == 0; });
+    if (test == std::end(cases))
+        return 1;
+
+    // results go to the original standard output, reports that drain the recorded events go nowhere
+    const int results = ::dup(STDOUT_FILENO);
+    const int null = ::open("/dev/null", O_WRONLY);
+    if (results < 0 or null < 0 or ::dup2(null, STDOUT_FILENO) < 0)
+        return 1;
+    std::FILE *out = ::fdopen(results, "w");
+
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < max_threads; threads *= 2)
+        thread_counts.push_back(threads);
+    thread_counts.push_back(max_threads);
+
+    for (std::size_t size: sizes)
+        for (unsigned threads: thread_counts) {
+            measure(size, threads, std::max<std::size_t>(ops / 16, 1), test->libc); // warm up
+            memstats_report("warm up");
+            const double ns = measure(size, threads, ops, test->libc);
+            memstats_report(name);
+            std::fprintf(out, "%s,%zu,%u,%zu,%.2f\n", name, size, threads, ops, ns);
+            std::fflush(out);
+        }
+    return 0;
+}
+
+// runs this program again for 'test', with its instrumentation set in the environment, and reads its results
+int spawn_case(const char *self, const Case &test, std::size_t ops, unsigned max_threads, std::string &results) {
+    std::vector<std::string> storage;
+    for (char **variable = environ; *variable; ++variable)
+        if (std::strncmp(*variable, "MEMSTATS_", 9) != 0)
+            storage.emplace_back(*variable);
+    storage.emplace_back("MEMSTATS_REPORT_AT_EXIT=false");
+    for (const char *const *variable = test.environment; *variable; ++variable)
+        storage.emplace_back(*variable);
+    std::vector<char *> environment;
+    for (std::string &variable: storage)
+        environment.push_back(&variable[0]);
+    environment.push_back(nullptr);
+
+    std::string ops_string = std::to_string(ops), threads_string = std::to_string(max_threads);
+    std::string case_string = test.name;
+    char case_option[] = "--case", ops_option[] = "--ops", threads_option[] = "--max-threads";
+    char *arguments[] = {const_cast<char *>(self), case_option, &case_string[0], ops_option, &ops_string[0],
+                         threads_option, &threads_string[0], nullptr};
+    int pipe_fds[2];
+    if (::pipe(pipe_fds) != 0)
+        return 1;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipe_fds[0]);
+    pid_t pid;
+    const int spawned = posix_spawn(&pid, self, &actions, nullptr, arguments, environment.data());
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(pipe_fds[1]);
+    if (spawned != 0) {
+        ::close(pipe_fds[0]);
+        return 1;
+    }
+    char buffer[4096];
+    for (ssize_t n; (n = ::read(pipe_fds[0], buffer, sizeof(buffer))) != 0;)
+        if (n > 0)
+            results.append(buffer, std::size_t(n));
+        else if (errno != EINTR)
+            break;
+    ::close(pipe_fds[0]);
+    int status = 0;
+    if (::waitpid(pid, &status, 0) < 0 or !WIFEXITED(status))
+        return 1;
+    return WEXITSTATUS(status);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const char *case_name = nullptr;
+    std::size_t ops = 1 << 18;
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::strcmp(argv[i], "--case") == 0)
+            case_name = argv[i + 1];
+        else if (std::strcmp(argv[i], "--ops") == 0)
+            ops = std::max(1ull, std::strtoull(argv[i + 1], nullptr, 10));
+        else if (std::strcmp(argv[i], "--max-threads") == 0)
+            max_threads = std::max(1ul, std::strtoul(argv[i + 1], nullptr, 10));
+        else
+            return std::fprintf(stderr, "Usage: %s [--ops <pairs per thread>] [--max-threads <n>]\n", argv[0]), 2;
+    }
+    if (case_name)
+        return run_case(case_name, ops, max_threads);
+
+    std::printf("case,size,threads,ops,ns_per_op,overhead_ns\n");
+    std::fflush(stdout);
+    std::map<std::pair<std::size_t, unsigned>, double> baseline; // ns of 'libc' by size and number of threads
+    for (const Case &test: cases) {
+        std::string results;
+        if (spawn_case(argv[0], test, ops, max_threads, results) != 0) {
+            std::fprintf(stderr, "Case '%s' failed\n", test.name);
+            return 1;
+        }
+        for (std::size_t begin = 0, end; (end = results.find('\n', begin)) != std::string::npos; begin = end + 1) {
+            const std::string line = results.substr(begin, end - begin);
+            std::size_t size = 0, line_ops = 0;
+            unsigned threads = 0;
+            double ns = 0;
+            if (std::sscanf(line.c_str(), "%*[^,],%zu,%u,%zu,%lf", &size, &threads, &line_ops, &ns) != 4)
+                continue;
+            if (test.libc)
+                baseline[std::make_pair(size, threads)] = ns;
+            auto found = baseline.find(std::make_pair(size, threads));
+            std::printf("%s,%.2f\n", line.c_str(), found != baseline.end() ? ns - found->second : 0.);
+        }
+        std::fflush(stdout);
+    }
+    return 0;
+}
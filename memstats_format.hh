@@ -0,0 +1,219 @@
+#ifndef MEMSTATS_FORMAT_HH
+#define MEMSTATS_FORMAT_HH
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+/** Formatting shared by 'memstats_report' and the offline 'memstats-analyze', so both print the same report.
+ * Nothing in here allocates: strings are returned in fixed-size buffers and histograms are drawn into a
+ * scratch buffer provided by the caller.
+ */
+
+// bin representation of percentage from 0% to 100%
+static const std::array<const char *, 4> memstats_str_precentage_punctuation{" ", ".", ":", "!"};
+static const std::array<const char *, 4> memstats_str_precentage_circle{" ", ".", "o", "O"};
+static const std::array<const char *, 5> memstats_str_precentage_shadow{" ", "░", "▒", "▓", "█"};
+static const std::array<const char *, 5> memstats_str_precentage_wire{" ", "-", "~", "=", "#"};
+static const std::array<const char *, 9> memstats_str_precentage_box{" ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+static const std::array<const char *, 10> memstats_str_precentage_number{
+    "0", "1", "2", "3", "4", "5", "6", "7", "8",
+    "9"
+};
+
+inline std::pair<char const *const *, std::size_t> memstats_str_hist_representation() {
+    if (const char *ptr = std::getenv("MEMSTATS_HISTOGRAM_REPRESENTATION")) {
+        if (std::strcmp(ptr, "box") == 0)
+            return std::make_pair(memstats_str_precentage_box.data(), memstats_str_precentage_box.size());
+        if (std::strcmp(ptr, "number") == 0)
+            return std::make_pair(memstats_str_precentage_number.data(), memstats_str_precentage_number.size());
+        if (std::strcmp(ptr, "punctuation") == 0)
+            return std::make_pair(memstats_str_precentage_punctuation.data(),
+                                  memstats_str_precentage_punctuation.size());
+        if (std::strcmp(ptr, "shadow") == 0)
+            return std::make_pair(memstats_str_precentage_shadow.data(), memstats_str_precentage_shadow.size());
+        if (std::strcmp(ptr, "wire") == 0)
+            return std::make_pair(memstats_str_precentage_wire.data(), memstats_str_precentage_wire.size());
+        if (std::strcmp(ptr, "circle") == 0)
+            return std::make_pair(memstats_str_precentage_circle.data(), memstats_str_precentage_circle.size());
+        std::cerr << "Option 'MEMSTATS_HISTOGRAM_REPRESENTATION=" << ptr << "' not known. Fallback on default 'box'\n";
+    }
+    return std::make_pair(memstats_str_precentage_box.data(), memstats_str_precentage_box.size());
+}
+
+inline unsigned short memstats_bins() {
+    if (const char *ptr = std::getenv("MEMSTATS_BINS")) {
+        char *end = nullptr;
+        const long bins = std::strtol(ptr, &end, 10);
+        if (end != ptr and bins > 0 and bins <= 0xffff)
+            return static_cast<unsigned short>(bins);
+        std::cerr << "Option 'MEMSTATS_BINS=" << ptr << "' not known. Fallback on default '15'\n";
+    }
+    return 15;
+}
+
+// short rendering of a number, e.g. '12kB'
+struct MemStatsShortString {
+    char str[16];
+};
+
+inline std::ostream &operator<<(std::ostream &out, const MemStatsShortString &string) {
+    return out << string.str;
+}
+
+static const std::array<char, 11> memstats_metric_prefix{' ', 'k', 'M', 'G', 'T', 'P', 'E', 'Z', 'Y', 'R', 'Q'};
+
+inline MemStatsShortString memstats_bytes_to_string(double estimate) {
+    const std::size_t bytes = std::llround(estimate);
+    const std::size_t base = bytes ? static_cast<std::size_t>(std::floor(std::log2(bytes) / 10)) : 0;
+    if (base >= memstats_metric_prefix.size())
+        throw std::out_of_range{"Too many bytes to use SI prefixes"};
+    MemStatsShortString string;
+    std::snprintf(string.str, sizeof(string.str), "%d%cB", short(bytes / (std::pow(1024, base))),
+                  memstats_metric_prefix[base]);
+    return string;
+}
+
+inline MemStatsShortString memstats_int_to_string(double estimate) {
+    const std::size_t val = std::llround(estimate);
+    const std::size_t base = val ? static_cast<std::size_t>(std::floor(std::log10(val) / 3)) : 0;
+    if (base >= memstats_metric_prefix.size())
+        throw std::out_of_range{"Integer is too big to use SI prefixes"};
+    MemStatsShortString string;
+    std::snprintf(string.str, sizeof(string.str), "%d%c", short(val / (std::pow(1000, base))),
+                  memstats_metric_prefix[base]);
+    return string;
+}
+
+// short rendering of a duration in nanoseconds, e.g. '12us'
+inline MemStatsShortString memstats_duration_to_string(double ns) {
+    static const std::array<const char *, 4> units{"ns", "us", "ms", "s"};
+    std::size_t unit = 0;
+    for (; unit + 1 != units.size() and ns >= 1000; ++unit)
+        ns /= 1000;
+    MemStatsShortString string;
+    std::snprintf(string.str, sizeof(string.str), "%d%s", int(ns), units[unit]);
+    return string;
+}
+
+/** Bucket of a lifetime of 'ns' nanoseconds: its 6 most significant bits, so that lifetime histograms
+ * keep one entry per bucket instead of one per distinct nanosecond.
+ */
+inline std::uint64_t memstats_lifetime_bucket(std::uint64_t ns) {
+    std::uint64_t low = 0;
+    for (std::uint64_t value = ns; value >= 64; value >>= 1)
+        low = (low << 1) | 1;
+    return std::max<std::uint64_t>(ns & ~low, 1);
+}
+
+/** Draws the histogram of 'size_freq' (pairs of value and count) with 'hist.size()' bins.
+ * 'hist' is scratch space of the caller.
+ */
+template<class Hist, class SizeFreq>
+void memstats_draw_histogram(std::ostream &out, Hist &hist, const SizeFreq &size_freq, std::size_t max_size,
+                             std::pair<char const *const *, std::size_t> str_precentage) {
+    std::fill(hist.begin(), hist.end(), 0.);
+    const std::size_t bins = hist.size();
+    double max_count = 0;
+    for (const auto &frec: size_freq) {
+        const std::size_t size = frec.first;
+        const double count = frec.second;
+        const std::size_t bin = (bins * (size - 1)) / max_size;
+        max_count = std::max(hist[bin] += count, max_count);
+    }
+    out << "[";
+    for (double count: hist) {
+        const std::size_t bin_entry =
+                max_count ? static_cast<std::size_t>((count * str_precentage.second) / max_count) : 0;
+        // maximum value (count==max_count) will be out of range so we need to guard agains that
+        out << str_precentage.first[std::min(bin_entry, str_precentage.second - 1)];
+    }
+    out << "]";
+}
+
+// histogram of allocation sizes followed by the maximum size
+template<class Hist, class SizeFreq>
+void memstats_format_histogram(std::ostream &out, Hist &hist, const SizeFreq &size_freq, std::size_t max_size,
+                               std::pair<char const *const *, std::size_t> str_precentage) {
+    memstats_draw_histogram(out, hist, size_freq, max_size, str_precentage);
+    out << std::left << std::setw(6) << memstats_bytes_to_string(double(max_size));
+}
+
+// draws 'values' relative to 'max_value' with the glyphs of 'str_precentage', followed by 'max_value' in bytes
+template<class Values>
+void memstats_format_sparkline(std::ostream &out, const Values &values, double max_value,
+                               std::pair<char const *const *, std::size_t> str_precentage) {
+    out << "[";
+    for (double value: values) {
+        const std::size_t entry = max_value ? static_cast<std::size_t>((value * str_precentage.second) / max_value) : 0;
+        out << str_precentage.first[std::min(entry, str_precentage.second - 1)];
+    }
+    out << "]" << std::left << std::setw(6) << memstats_bytes_to_string(max_value);
+}
+
+// start of a line of the report: histogram, accumulated bytes and number of allocations, the caller adds the position
+template<class Hist, class SizeFreq>
+std::ostream &memstats_format_line(std::ostream &out, Hist &hist, const SizeFreq &size_freq, std::size_t max_size,
+                                   double size, double count,
+                                   std::pair<char const *const *, std::size_t> str_precentage) {
+    memstats_format_histogram(out, hist, size_freq, max_size, str_precentage);
+    return out << " | " << std::right << std::setw(6) << memstats_bytes_to_string(size) << '('
+            << std::left << std::setw(5) << memstats_int_to_string(count) << ") | ";
+}
+
+// median of 'lifetime_freq' (pairs of lifetime and count), 'sorted' is scratch space of the caller
+template<class Sorted, class LifetimeFreq>
+std::uint64_t memstats_lifetime_median(Sorted &sorted, const LifetimeFreq &lifetime_freq, double count) {
+    sorted.assign(lifetime_freq.begin(), lifetime_freq.end());
+    std::sort(sorted.begin(), sorted.end());
+    double below = 0;
+    for (const auto &frec: sorted)
+        if ((below += frec.second) * 2 >= count)
+            return frec.first;
+    return 0;
+}
+
+// start of a line of lifetimes: histogram up to the longest lifetime, median lifetime and number of freed allocations
+template<class Hist, class LifetimeFreq>
+std::ostream &memstats_format_lifetime_line(std::ostream &out, Hist &hist, const LifetimeFreq &lifetime_freq,
+                                            std::uint64_t max_lifetime, std::uint64_t median, double count,
+                                            std::pair<char const *const *, std::size_t> str_precentage) {
+    memstats_draw_histogram(out, hist, lifetime_freq, static_cast<std::size_t>(max_lifetime), str_precentage);
+    return out << std::left << std::setw(6) << memstats_duration_to_string(double(max_lifetime)) << " | "
+            << std::right << std::setw(6) << memstats_duration_to_string(double(median)) << '('
+            << std::left << std::setw(5) << memstats_int_to_string(count) << ") | ";
+}
+
+inline void memstats_print_legend(std::ostream &out) {
+    out << "\nMemStats Legend:\n\n";
+    out << "  [{hist}]{max} | {accum}({count}) | {pos}\n\n";
+    out << "• hist:   Distribution of number of 'new' allocations for a given number of bytes\n";
+    out << "• max:    Maximum allocation requested to 'new'\n";
+    out << "• accum:  Accumulated number of bytes requested\n";
+    out << "• count:  Number of total allocation requests\n";
+    out << "• pos:    Position of the measurment\n";
+    out << "\n  [{hist}]{longest} | {median}({freed}) | {pos}\n\n";
+    out << "• hist:    Distribution of the lifetimes of freed allocations, from allocation to free\n";
+    out << "• longest: Longest lifetime\n";
+    out << "• median:  Median lifetime\n";
+    out << "• freed:   Number of freed allocations\n";
+    out << "\nMemStats Histogram Legend:\n\n";
+    const auto str_precentage = memstats_str_hist_representation();
+    double per_width = 100. / str_precentage.second;
+    for (std::size_t i = 0; i != str_precentage.second; ++i)
+        out << "• \'" << str_precentage.first[i] << "\' -> [" << std::fixed
+                << std::setw(4) << std::setprecision(1) << i * per_width
+                << "%, " << std::setw(5) << (i + 1) * per_width << '%'
+                << (i + 1 == str_precentage.second ? ']' : ')') << std::endl;
+}
+
+#endif // MEMSTATS_FORMAT_HH
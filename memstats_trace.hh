@@ -0,0 +1,97 @@
+#ifndef MEMSTATS_TRACE_HH
+#define MEMSTATS_TRACE_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/** Binary trace file written with 'MEMSTATS_TRACE_FILE' and read by 'memstats-analyze'.
+ *
+ * The file starts with a 'MemStatsTraceHeader' and continues with chunks of 'memstats_trace_chunk_size' bytes.
+ * Each chunk is owned by one writer: either events of one thread, or the tables of interned stacks and regions.
+ * A writer publishes its records by a release-store on 'MemStatsTraceChunk::used' after writing them, so a
+ * chunk is always valid up to 'used', even if the process dies in the middle of the run.
+ * Return addresses of stacks are resolved to names only when the process exits cleanly, in symbol chunks.
+ * Chunks that were never handed out are zero-filled, i.e. their 'type' is 'memstats_trace_unused'.
+ */
+
+constexpr std::uint64_t memstats_trace_magic = 0x31435254534d454dull; // "MEMSTRC1"
+constexpr std::uint32_t memstats_trace_version = 2;
+constexpr std::size_t memstats_trace_chunk_size = std::size_t(1) << 16;
+
+struct MemStatsTraceHeader {
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t chunk_size;
+    std::uint64_t header_size;
+    std::uint64_t sample_rate;             // 'MEMSTATS_SAMPLE_RATE' of the run, 0 if every allocation is recorded
+    std::atomic<std::uint32_t> clean_exit; // set once the process reached its at-exit report
+    std::uint32_t reserved[7];
+};
+
+static_assert(sizeof(MemStatsTraceHeader) == 64, "Trace header must have a fixed size");
+
+enum MemStatsTraceChunkType : std::uint32_t {
+    memstats_trace_unused = 0,
+    memstats_trace_events = 1,
+    memstats_trace_stacks = 2,
+    memstats_trace_symbols = 3,
+    memstats_trace_regions = 4,
+};
+
+struct MemStatsTraceChunk {
+    std::uint32_t type;
+    std::uint32_t thread;             // index of the writing thread for event chunks
+    std::atomic<std::uint32_t> used;  // published records for event chunks, published bytes for the others
+    std::uint32_t reserved0;
+    std::uint64_t base_time;          // nanoseconds since the start of the trace, event times are relative to it
+    std::uint64_t thread_id;          // 'std::thread::id' of the writing thread for event chunks
+    std::uint64_t reserved[4];
+};
+
+static_assert(sizeof(MemStatsTraceChunk) == 64, "Trace chunk header must have a fixed size");
+
+// an allocation ('size' > 0) or a deallocation ('size' == 0) of the thread of its chunk
+struct MemStatsTraceEvent {
+    std::uint64_t ptr;
+    std::uint64_t size;
+    std::uint64_t time;      // nanoseconds since 'MemStatsTraceChunk::base_time', so a long pause needs no new chunk
+    std::uint32_t stack;     // id of the interned stack, 0 if none
+    std::uint8_t form;       // flags of the allocation function, see 'MemStatsForm'
+    std::uint8_t alignment;  // log2 of the requested alignment, 0 if default
+    std::uint16_t region;    // id of the innermost region of the thread, 0 if none
+};
+
+static_assert(sizeof(MemStatsTraceEvent) == 32, "Trace event must have a fixed size");
+
+constexpr std::size_t memstats_trace_chunk_events =
+        (memstats_trace_chunk_size - sizeof(MemStatsTraceChunk)) / sizeof(MemStatsTraceEvent);
+
+// stack chunks hold a sequence of these, each followed by 'depth' return addresses of 64 bits
+struct MemStatsTraceStack {
+    std::uint32_t id;
+    std::uint32_t depth;
+};
+
+static_assert(sizeof(MemStatsTraceStack) == 8, "Trace stack must have a fixed size");
+
+// symbol chunks, written at exit, hold a sequence of these, each followed by 'length' characters padded to 8 bytes
+struct MemStatsTraceSymbol {
+    std::uint64_t address;
+    std::uint32_t length;
+    std::uint32_t reserved;
+};
+
+static_assert(sizeof(MemStatsTraceSymbol) == 16, "Trace symbol must have a fixed size");
+
+// region chunks hold a sequence of these, each followed by 'length' characters of the name padded to 8 bytes
+struct MemStatsTraceRegion {
+    std::uint32_t id;
+    std::uint32_t parent; // id of the region around this one, 0 if none
+    std::uint32_t length;
+    std::uint32_t reserved;
+};
+
+static_assert(sizeof(MemStatsTraceRegion) == 16, "Trace region must have a fixed size");
+
+#endif // MEMSTATS_TRACE_HH